@@ -0,0 +1,372 @@
+/******************************************************************************
+ * FILENAME: bench.c
+ * PROVIDES: Multithreaded allocator benchmarks, run at 1..N threads, reporting
+ *           throughput, p50/p99/p999 latency of single calls and peak RSS
+ * BUILD:    gcc -O2 -pthread -DMEM_NO_MAIN mem.c bench.c -o bench -lm
+ * USAGE:    ./bench [max_threads [policy [ops_per_thread]]]
+ * *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "mem.h"
+
+/* Workloads */
+/* churn: every thread allocates and frees 16-1024 byte objects in a slot array */
+/* of its own, the classic per-thread fast path */
+/* prodcons: every thread allocates objects and hands them to the next thread */
+/* through a ring, which frees them, so every free is a cross-thread free */
+/* larson: server simulation after Larson and Krishnan. Threads replace random */
+/* objects of a shared slot array and are retired every round, the next */
+/* generation of threads frees what the previous one allocated */
+/* powerlaw: churn with sizes drawn from a Pareto distribution, mostly small */
+/* objects with a long tail up to 1 MiB that reaches the direct mappings */
+#define WORKLOADS 4
+const char *workload_names[WORKLOADS] = { "churn", "prodcons", "larson", "powerlaw" };
+
+#define SLOTS 1024
+#define RING_SIZE 1024
+#define LARSON_ROUNDS 8
+#define MAX_THREADS 64
+/* One call in LATENCY_EVERY is timed, timing them all would cost more than */
+/* most of the calls themselves */
+#define LATENCY_EVERY 8
+#define LATENCY_SAMPLES (1 << 16)
+#define DEFAULT_OPS 1000000L
+
+typedef struct
+{
+    int index;
+    long ops;
+    unsigned long seed;
+    /* Latencies of the timed calls, in ns */
+    long *latency;
+    long samples;
+} worker;
+
+/* Single producer single consumer ring, thread i fills ring i + 1 */
+typedef struct
+{
+    void *slots[RING_SIZE];
+    long head __attribute__((aligned(64)));
+    long tail __attribute__((aligned(64)));
+} ring;
+
+int workload;
+int thread_count;
+long ops_per_thread;
+worker workers[MAX_THREADS];
+ring *rings;
+void **larson_slots;
+int larson_round;
+
+long now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000000000L + time.tv_nsec;
+}
+
+unsigned long nextRandom(worker *self)
+{
+    self->seed ^= self->seed << 13;
+    self->seed ^= self->seed >> 7;
+    self->seed ^= self->seed << 17;
+    return self->seed;
+}
+
+/* Size of the next object: uniform, or Pareto with alpha 1.2 from 16 bytes */
+size_t nextSize(worker *self)
+{
+    if (workload != 3)
+    {
+        return 16 + nextRandom(self) % 1009;
+    }
+    double u = (double)(nextRandom(self) >> 11) / (double)(1UL << 53);
+    double size = 16.0 / pow(1.0 - u, 1.0 / 1.2);
+    return size > (1 << 20) ? (1 << 20) : (size_t)size;
+}
+
+void record(worker *self, long start)
+{
+    if (self->samples < LATENCY_SAMPLES)
+    {
+        self->latency[self->samples++] = now() - start;
+    }
+}
+
+/* Allocates, timing one call in LATENCY_EVERY, and touches the object */
+void *timedAlloc(worker *self, long op, size_t size)
+{
+    void *ptr;
+    if (op % LATENCY_EVERY == 0)
+    {
+        long start = now();
+        ptr = Mem_Alloc(size);
+        record(self, start);
+    }
+    else
+    {
+        ptr = Mem_Alloc(size);
+    }
+    if (ptr != NULL)
+    {
+        *(char *)ptr = 1;
+    }
+    return ptr;
+}
+
+void timedFree(worker *self, long op, void *ptr)
+{
+    if (op % LATENCY_EVERY == 0)
+    {
+        long start = now();
+        Mem_Free(ptr);
+        record(self, start);
+    }
+    else
+    {
+        Mem_Free(ptr);
+    }
+}
+
+/* churn and powerlaw */
+void runChurn(worker *self)
+{
+    void **slots = calloc(SLOTS, sizeof(void *));
+    for (long op = 0; op < self->ops; op++)
+    {
+        long i = (long)(nextRandom(self) % SLOTS);
+        if (slots[i] != NULL)
+        {
+            timedFree(self, op, slots[i]);
+            slots[i] = NULL;
+        }
+        else
+        {
+            slots[i] = timedAlloc(self, op, nextSize(self));
+        }
+    }
+    for (long i = 0; i < SLOTS; i++)
+    {
+        if (slots[i] != NULL)
+        {
+            Mem_Free(slots[i]);
+        }
+    }
+    free(slots);
+}
+
+void runProdCons(worker *self)
+{
+    ring *out = &rings[(self->index + 1) % thread_count];
+    ring *in = &rings[self->index];
+    long produced = 0, consumed = 0, op = 0;
+    //Each thread receives exactly what its neighbour produces
+    while (produced < self->ops / 2 || consumed < self->ops / 2)
+    {
+        int progress = 0;
+        long tail = __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE);
+        if (produced < self->ops / 2 && out->head - tail < RING_SIZE)
+        {
+            progress = 1;
+            out->slots[out->head % RING_SIZE] = timedAlloc(self, op++, nextSize(self));
+            __atomic_store_n(&out->head, out->head + 1, __ATOMIC_RELEASE);
+            produced++;
+        }
+        long head = __atomic_load_n(&in->head, __ATOMIC_ACQUIRE);
+        if (in->tail < head)
+        {
+            void *ptr = in->slots[in->tail % RING_SIZE];
+            __atomic_store_n(&in->tail, in->tail + 1, __ATOMIC_RELEASE);
+            if (ptr != NULL)
+            {
+                timedFree(self, op++, ptr);
+            }
+            consumed++;
+            progress = 1;
+        }
+        //Full ring and nothing to free, let the neighbour run
+        if (!progress)
+        {
+            sched_yield();
+        }
+    }
+}
+
+void runLarson(worker *self)
+{
+    //Every round a new thread takes over another thread's share of the slots
+    void **slots = larson_slots + (long)((self->index + larson_round) % thread_count) * SLOTS;
+    long ops = self->ops / LARSON_ROUNDS;
+    for (long op = 0; op < ops; op += 2)
+    {
+        long i = (long)(nextRandom(self) % SLOTS);
+        if (slots[i] != NULL)
+        {
+            timedFree(self, op, slots[i]);
+        }
+        slots[i] = timedAlloc(self, op + 1, nextSize(self));
+    }
+}
+
+void *runWorker(void *arg)
+{
+    worker *self = (worker *)arg;
+    if (workload == 1)
+    {
+        runProdCons(self);
+    }
+    else if (workload == 2)
+    {
+        runLarson(self);
+    }
+    else
+    {
+        runChurn(self);
+    }
+    return NULL;
+}
+
+int compareLongs(const void *a, const void *b)
+{
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Peak resident set of the process in KiB, from /proc */
+long peakRss()
+{
+    char line[256];
+    long rss = 0;
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status == NULL)
+    {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (strncmp(line, "VmHWM:", 6) == 0)
+        {
+            rss = atol(line + 6);
+        }
+    }
+    fclose(status);
+    return rss;
+}
+
+/* Runs the current workload at thread_count threads and prints a row */
+/* Meant to run in a child process, Mem_Init can only be called once */
+void runBenchmark(int policy)
+{
+    pthread_t threads[MAX_THREADS];
+    Mem_SetOption(MEM_OPT_ARENAS, thread_count);
+    if (Mem_SetOption(MEM_OPT_MAX_FOOTPRINT, 1L << 34) != 0)
+    {
+        Mem_SetOption(MEM_OPT_MAX_FOOTPRINT, 0xffe00000L);
+    }
+    if (Mem_Init(64L << 20, policy) != 0)
+    {
+        return;
+    }
+    rings = calloc((size_t)thread_count, sizeof(ring));
+    larson_slots = calloc((size_t)thread_count * SLOTS, sizeof(void *));
+    for (int t = 0; t < thread_count; t++)
+    {
+        workers[t].index = t;
+        workers[t].ops = ops_per_thread;
+        workers[t].seed = 0x9e3779b97f4a7c15UL * (unsigned long)(t + 1);
+        workers[t].latency = malloc(LATENCY_SAMPLES * sizeof(long));
+        workers[t].samples = 0;
+    }
+
+    long start = now();
+    int rounds = workload == 2 ? LARSON_ROUNDS : 1;
+    for (larson_round = 0; larson_round < rounds; larson_round++)
+    {
+        for (int t = 0; t < thread_count; t++)
+        {
+            pthread_create(&threads[t], NULL, runWorker, &workers[t]);
+        }
+        for (int t = 0; t < thread_count; t++)
+        {
+            pthread_join(threads[t], NULL);
+        }
+    }
+    long elapsed = now() - start;
+
+    long samples = 0;
+    for (int t = 0; t < thread_count; t++)
+    {
+        samples = samples + workers[t].samples;
+    }
+    long *latency = malloc((size_t)(samples > 0 ? samples : 1) * sizeof(long));
+    samples = 0;
+    for (int t = 0; t < thread_count; t++)
+    {
+        memcpy(latency + samples, workers[t].latency, workers[t].samples * sizeof(long));
+        samples = samples + workers[t].samples;
+    }
+    qsort(latency, (size_t)samples, sizeof(long), compareLongs);
+    if (samples == 0)
+    {
+        latency[0] = 0;
+        samples = 1;
+    }
+
+    long ops = ops_per_thread * thread_count;
+    fprintf(stdout, "%-9s %7d %10.2f %8ld %8ld %8ld %9.1f\n", workload_names[workload], thread_count,
+        ops / (elapsed / 1e9) / 1e6, latency[samples / 2], latency[samples * 99 / 100],
+        latency[samples * 999 / 1000], peakRss() / 1024.0);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int policy = argc > 2 ? atoi(argv[2]) : 3;
+    ops_per_thread = argc > 3 ? atol(argv[3]) : DEFAULT_OPS;
+    if (max_threads < 1 || max_threads > MAX_THREADS || policy < 0 || policy > 4 || ops_per_thread < 2)
+    {
+        fprintf(stderr, "usage: %s [max_threads (1-%d) [policy (0-4) [ops_per_thread]]]\n",
+            argv[0], MAX_THREADS);
+        return 1;
+    }
+
+    fprintf(stdout, "policy %d, %ld ops per thread, latency of single calls in ns\n", policy, ops_per_thread);
+    fprintf(stdout, "%-9s %7s %10s %8s %8s %8s %9s\n", "workload", "threads", "Mops/s", "p50", "p99", "p999",
+        "RSS MiB");
+    for (workload = 0; workload < WORKLOADS; workload++)
+    {
+        //1, 2, 4, ... and max_threads itself
+        for (thread_count = 1; thread_count <= max_threads;
+            thread_count = thread_count < max_threads && thread_count * 2 > max_threads ? max_threads : thread_count * 2)
+        {
+            fflush(stdout);
+            pid_t child = fork();
+            if (child == 0)
+            {
+                runBenchmark(policy);
+                _exit(0);
+            }
+            if (child < 0)
+            {
+                fprintf(stderr, "Error:bench.c: Cannot fork\n");
+                return 1;
+            }
+            waitpid(child, NULL, 0);
+            if (thread_count == max_threads)
+            {
+                break;
+            }
+        }
+    }
+    return 0;
+}
@@ -5,64 +5,364 @@
  * PROVIDES: Contains a set of library functions for memory allocation
  * *****************************************************************************/
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/wait.h>
 #include <string.h>
 #include "mem.h"
 #include <assert.h>
 #include <stdlib.h>
-
-int fit;
+#include <pthread.h>
+
+/* Every payload starts on a multiple of MEM_ALIGN */
+/* Header plus payload of every block fills whole MEM_ALIGN granules, so */
+/* payloads stay aligned all the way from the page aligned start of an arena */
+#define MEM_ALIGN 16
+
+/* Build with -DMEM_COMPACT_HEADER for 8-byte headers: the link is a 32-bit */
+/* offset and there is no cookie, so pointers passed to Mem_Free are checked */
+/* against the link instead (see getHeader). Headers then sit 8 bytes before */
+/* a granule boundary. */
+#ifdef MEM_COMPACT_HEADER
+#define HEADER_ALIGN 4
+#else
+#define HEADER_ALIGN MEM_ALIGN
+#endif
+
+/* Largest region the allocator can manage. Compact headers hold 32-bit offsets */
+/* and sizes, full headers keep 40 bits of size_status for the size */
+#ifdef MEM_COMPACT_HEADER
+#define MEM_MAX_REGION 0xffe00000L
+#else
+#define MEM_MAX_REGION (1L << 39)
+#endif
 
 /* this structure serves as the header for each block */
 typedef struct block_hd
 {
     /* The blocks are maintained as a linked list */
     /* The blocks are ordered in the increasing order of addresses */
-    struct block_hd *next;
-
-    /* size of the block is always a multiple of 4 */
-    /* ie, last two bits are always zero - can be used to store other information*/
+    /* Always read and written through getNext() and setNext() */
+    /* It holds the offset of the next header from this one, 0 for none. The */
+    /* list runs in address order, so it never points backwards, and it stays */
+    /* valid wherever the region is mapped, see Mem_HeapOpen */
+#ifdef MEM_COMPACT_HEADER
+    unsigned int next;
+#else
+    unsigned long next;
+#endif
+
+    /* size of the block is always a multiple of MEM_ALIGN (16) */
+    /* ie, last four bits are always zero - can be used to store other information*/
     /* LSB = 0 => free block */
     /* LSB = 1 => allocated/busy block */
+    /* Bit 1 (PREV_FREE) = 1 => the block right before this one is free */
 
     /* So for a free block, the value stored in size_status will be the same as the block size*/
     /* And for an allocated block, the value stored in size_status will be one more than the block size*/
 
     /* The value stored here does not include the space required to store the header */
+    /* (except with MEM_COMPACT_HEADER, where it counts the whole block in granules */
+    /* above the status bits and getSize() takes the header back off, see SIZE_BIAS) */
 
-    /* Example: */
-    /* For a block with a payload of 24 bytes (ie, 24 bytes data + an additional 8 bytes for header) */
-    /* If the block is allocated, size_status should be set to 25, not 24!, not 23! not 32! not 33!, not 31! */
-    /* If the block is free, size_status should be set to 24, not 25!, not 23! not 32! not 33!, not 31! */
-    int size_status;
-
-} block_header;
+    /* With full headers size_status is 64 bits wide: the size and status bits */
+    /* take the low 40 bits and the header cookie the high 24, see setMagic() */
 
-/* Global variable - This will always point to the first block */
-/* ie, the block with the lowest address */
-block_header *list_head = NULL;
-
-/**
- * Variable to keep track of heap size
- * */
- //int allocsize = 0;
+    /* Example: */
+    /* For a block with a payload of 32 bytes (ie, 32 bytes data + an additional 16 bytes for header) */
+    /* If the block is allocated, size_status should be set to 33, not 32!, not 31! not 48! not 49!, not 47! */
+    /* If the block is free, size_status should be set to 32, not 33!, not 31! not 48! not 49!, not 47! */
+#ifdef MEM_COMPACT_HEADER
+    unsigned int size_status;
+#else
+    unsigned long size_status;
+#endif
+
+} __attribute__((aligned(HEADER_ALIGN))) block_header;
+
+/* What size_status holds on top of the payload size, 0 unless headers are compact */
+#define SIZE_BIAS ((MEM_ALIGN - (int)sizeof(block_header)) % MEM_ALIGN)
+
+#define PREV_FREE 0x02
+/* Bit 2 (MMAPPED) = 1 => the block has a mapping of its own, see mmapAlloc() */
+#define MMAPPED 0x04
+/* Bit 3 (QUEUED) = 1 => the busy block has been freed and waits on a quick list, see deferFree() */
+#define QUEUED 0x08
+
+/* Two-Level Segregated Fit (policy 3) */
+/* Free blocks are kept in per-class doubly linked lists. The first level splits sizes */
+/* by power of two, the second level splits every power of two into TLSF_SL_COUNT */
+/* linear ranges. One bit per non-empty list lets us find a fitting class with two */
+/* find-first-set operations instead of walking list_head. */
+#define TLSF_SL_LOG 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG)
+/* Sizes below 1 << TLSF_FL_SHIFT all go to first level 0, in steps of MEM_ALIGN bytes */
+#define TLSF_FL_SHIFT (TLSF_SL_LOG + 4)
+/* One first level per power of two below MEM_MAX_REGION */
+#define TLSF_FL_COUNT (39 - TLSF_FL_SHIFT + 1)
+
+/* Buddy system (policy 4) */
+/* Every block is a power of two of at least BUDDY_MIN_BLOCK bytes, header */
+/* included, and starts at a multiple of its size from buddyBase(). The two */
+/* halves of a block are buddies: the address of one is that of the other with */
+/* the bit of their size flipped, so a freed block finds the block it merges */
+/* with by XOR instead of a search, and splits and merges walk the orders, */
+/* O(log n) steps at most. Free blocks sit on one list per order, and a bitmap */
+/* of the non-empty orders finds the smallest one that fits. */
+#define BUDDY_MIN_ORDER 6
+#define BUDDY_MIN_BLOCK (1L << BUDDY_MIN_ORDER)
+/* One order per power of two up to MEM_MAX_REGION */
+#define BUDDY_ORDERS 40
+
+/* Small objects live in slabs, see slabAlloc() */
+#define SLAB_SIZE 4096
+#define SLAB_CLASS_SIZE 16
+#define SLAB_CLASSES 16
+#define SLAB_MAX_SIZE (SLAB_CLASSES * SLAB_CLASS_SIZE)
+
+/* Deferred coalescing keeps one quick list per block size up to QUICK_MAX_SIZE */
+/* bytes, of at most QUICK_MAX_COUNT blocks each, see deferFree() */
+#define QUICK_MAX_SIZE 4096
+#define QUICK_CLASSES (QUICK_MAX_SIZE / MEM_ALIGN + 1)
+#define QUICK_MAX_COUNT 32
+
+/* Each arena is an independent heap carved out of its own slice of the region */
+/* It has its own block list, free indexes and lock, so threads working in */
+/* different arenas never touch the same headers or contend on the same lock. */
+/* Aligned to a cache line so that neighbouring arenas do not share one. */
+typedef struct arena_hd
+{
+    /* Serializes every access to the block list and free indexes of this arena */
+    pthread_mutex_t lock;
+
+    /* Allocation policy, the same for every arena of the process heap */
+    int fit;
+
+    /* This will always point to the first block of the arena */
+    /* ie, the block with the lowest address */
+    block_header *list_head;
+
+    /* Bounds of the slice, used to validate pointers passed to Mem_Free */
+    char *region_start;
+    char *region_end;
+
+    /* No payload at or above this address has ever been handed out. The memory */
+    /* there is still zero from /dev/zero, except for the links and the footer of */
+    /* the free block it belongs to, so Mem_Calloc does not clear it again */
+    char *clean;
+
+    /* TLSF (policy 3): class bitmaps and list heads */
+    unsigned int tlsf_fl_bitmap;
+    unsigned int tlsf_sl_bitmap[TLSF_FL_COUNT];
+    block_header *tlsf_free[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+    /* Best fit (policy 0): root of the size-ordered treap */
+    block_header *tree_root;
+
+    /* Buddy system (policy 4): non-empty orders and list heads */
+    unsigned long buddy_bitmap;
+    block_header *buddy_free[BUDDY_ORDERS];
+
+    /* Worst fit (policy 2): max-heap array and its fill */
+    block_header **heap_array;
+    long heap_count;
+
+    /* Slabs with at least one free slot, per size class */
+    struct slab_hd *slabs[SLAB_CLASSES];
+    /* One byte per SLAB_SIZE of the arena's stride, set where a slab starts */
+    unsigned char *slab_map;
+
+    /* Freed blocks waiting to be coalesced, per exact size, and how many */
+    block_header *quick[QUICK_CLASSES];
+    int quick_counts[QUICK_CLASSES];
+    long quick_total;
+
+    /* Heaps opened from a file, see Mem_HeapOpen: the header at the start of */
+    /* the mapping, NULL for other arenas, and the file, kept open and locked */
+    /* until the heap is destroyed */
+    struct heap_file_hd *file;
+    int file_fd;
+    /* Offset of the root object from region_start, 0 for none */
+    long root;
+    /* Bumped by Mem_HeapReset, it is part of the header cookies */
+    unsigned long generation;
+    /* Neighbours in the list of live heaps, see forkPrepare() */
+    struct arena_hd *next_heap;
+    struct arena_hd *prev_heap;
+
+    /* Statistics, see Mem_GetStats. Free blocks are counted as they enter and */
+    /* leave the free index, searches by the nodes they visit */
+    long free_bytes;
+    long free_blocks;
+    /* Free slots of the slabs, which hold busy blocks, in bytes */
+    long slab_free_bytes;
+    long walk_calls;
+    long walk_steps;
+    long walk_max;
+} __attribute__((aligned(64))) mem_arena;
+
+#define MAX_ARENAS 64
+
+mem_arena arenas[MAX_ARENAS];
+int arena_count = 1;
+
+/* All arenas share one reservation of address space, arena i starts at */
+/* region_base + i * arena_stride so the owner of a pointer is found with one */
+/* division. An arena maps memory at the front of its stride and grows towards */
+/* the end of it on demand, see growArena(). */
+char *region_base = NULL;
+long arena_stride = 0;
+
+/* Growth settings, see Mem_SetOption */
+long max_footprint = 0;
+int growth_percent = 100;
+
+/* Requests of at least this many bytes get a mapping of their own, 0 for never */
+long mmap_threshold = 256 * 1024;
+
+/* Freed blocks an arena queues before it coalesces them, 0 to coalesce right away */
+long quick_limit = 0;
+
+/* Transparent huge pages, see Mem_SetOption */
+#define HUGE_PAGE_SIZE (2L * 1024 * 1024)
+int huge_pages = 0;
+
+/* /dev/zero, kept open to map more of the region when it grows */
+int zero_fd = -1;
+
+/* Arena the calling thread allocates from, handed out round-robin */
+__thread mem_arena *thread_arena = NULL;
+int next_arena = 0;
+
+void insertFree(mem_arena *arena, block_header *ptr);
+void touchBlock(mem_arena *arena, block_header *ptr);
+void setMagic(mem_arena *arena, block_header *ptr);
+void setFence(mem_arena *arena, block_header *ptr);
+void setSize(block_header *ptr, long size, int flags);
+long getSize(block_header *ptr);
+void setNext(block_header *node, block_header *next);
+void setFooter(block_header *ptr);
+int heapSetup(mem_arena *arena, long region_size, int fd);
+long requestSize(size_t size);
+int slabSetup(mem_arena *arena, long region_size, int fd);
+int mapChunk(char *addr, long length);
+long mapGranule();
+long heapCapacity(long region_size);
+void initUndo(int count, long stride);
+long objectSize(void *ptr);
+void deferFree(mem_arena *arena, block_header *ptr);
+block_header *quickPop(mem_arena *arena, int i);
+int quickClass(long size);
+void quickDrain(mem_arena *arena);
+int isBusy(block_header *ptr);
+void forkPrepare();
+void forkRelease();
+void forkChild();
+void forkRegister();
+void removeFree(mem_arena *arena, block_header *ptr);
+block_header *combine(block_header *p1, block_header *p2);
+void buddySplit(mem_arena *arena, block_header *ptr, long size);
+void buddyFree(mem_arena *arena, block_header *ptr);
+void buddyExtend(mem_arena *arena, char *from, char *to, int flags);
+block_header *buddyAligned(mem_arena *arena, long size, long align);
+char *buddyBase(mem_arena *arena);
+void arenaFormat(mem_arena *arena);
+int heapClose(mem_arena *heap);
+
+/* Function used to tune the allocator before Mem_Init */
+/* Argument - option: one of the MEM_OPT_* values in mem.h
+            value: the new setting */
+/* MEM_OPT_ARENAS: number of independent arenas (1 to 64, default 1) */
+/* MEM_OPT_MAX_FOOTPRINT: bytes the heap may grow to, default is the size given */
+/*                        to Mem_Init, ie no growth */
+/* MEM_OPT_GROWTH_FACTOR: how much an arena grows when nothing fits, in percent */
+/*                        of its current size (default 100, ie doubling) */
+/* MEM_OPT_HUGE_PAGES: 1 aligns the region to 2 MiB and asks the kernel for */
+/*                     transparent huge pages (default 0) */
+/* MEM_OPT_MMAP_THRESHOLD: requests of at least this many bytes bypass the region */
+/*                         and are mapped on their own (default 256 KiB, 0 never) */
+/* MEM_OPT_DEFER_COALESCE: freed blocks of up to 4 KiB are queued per size and */
+/*                         coalesced in bulk once an arena holds more than this */
+/*                         many of them (default 0, coalesce on every free) */
+/* Returns 0 on success and -1 on failure */
+int Mem_SetOption(int option, long value)
+{
+    if (region_base != NULL)
+    {
+        fprintf(stderr, "Error:mem.c: Options must be set before Mem_Init\n");
+        return -1;
+    }
+    switch (option)
+    {
+    case MEM_OPT_ARENAS:
+        if (value < 1 || value > MAX_ARENAS)
+        {
+            return -1;
+        }
+        arena_count = (int)value;
+        return 0;
+    case MEM_OPT_MAX_FOOTPRINT:
+        if (value < 0 || value > MEM_MAX_REGION)
+        {
+            return -1;
+        }
+        max_footprint = value;
+        return 0;
+    case MEM_OPT_GROWTH_FACTOR:
+        if (value < 1 || value > 10000)
+        {
+            return -1;
+        }
+        growth_percent = (int)value;
+        return 0;
+    case MEM_OPT_HUGE_PAGES:
+        if (value != 0 && value != 1)
+        {
+            return -1;
+        }
+        huge_pages = (int)value;
+        return 0;
+    case MEM_OPT_MMAP_THRESHOLD:
+        if (value < 0)
+        {
+            return -1;
+        }
+        mmap_threshold = value;
+        return 0;
+    case MEM_OPT_DEFER_COALESCE:
+        if (value < 0)
+        {
+            return -1;
+        }
+        quick_limit = value;
+        return 0;
+    default:
+        return -1;
+    }
+}
 
  /* Function used to Initialize the memory allocator */
  /* Not intended to be called more than once by a program */
  /* Argument - sizeOfRegion: Specifies the size of the chunk which needs to be allocated
-            policy: indicates the policy to use eg: best fit is 0*/
+            policy: indicates the policy to use eg: best fit is 0, 4 for the buddy system*/
+ /* With several arenas the region is split evenly between them */
+ /* Address space for MEM_OPT_MAX_FOOTPRINT is reserved up front, but only */
+ /* sizeOfRegion bytes are mapped until an allocation needs more */
             /* Returns 0 on success and -1 on failure */
-int Mem_Init(int sizeOfRegion, int policy)
+int Mem_Init(size_t sizeOfRegion, int policy)
 {
-    int pagesize;
-    int padsize;
+    long pagesize;
+    long padsize;
     int fd;
-    int alloc_size;
+    long slice_size;
+    long stride;
+    long reserve;
     void *space_ptr;
     static int allocated_once = 0;
 
@@ -71,20 +371,46 @@ int Mem_Init(int sizeOfRegion, int policy)
         fprintf(stderr, "Error:mem.c: Mem_Init has allocated space during a previous call\n");
         return -1;
     }
-    if (sizeOfRegion <= 0)
+    if (sizeOfRegion == 0)
     {
         fprintf(stderr, "Error:mem.c: Requested block size is not positive\n");
         return -1;
     }
+    if (sizeOfRegion > MEM_MAX_REGION)
+    {
+        fprintf(stderr, "Error:mem.c: Requested block size is too large\n");
+        return -1;
+    }
+    if (policy < 0 || policy > 4)
+    {
+        fprintf(stderr, "Error:mem.c: Unknown allocation policy\n");
+        return -1;
+    }
 
-    /* Get the pagesize */
-    pagesize = getpagesize();
+    /* Get the pagesize, huge pages are mapped in whole huge pages */
+    pagesize = mapGranule();
 
-    /* Calculate padsize as the padding required to round up sizeOfRegion to a multiple of pagesize */
-    padsize = sizeOfRegion % pagesize;
+    /* Every arena gets an equal share, rounded up to a multiple of pagesize */
+    slice_size = ((long)sizeOfRegion + arena_count - 1) / arena_count;
+    padsize = slice_size % pagesize;
     padsize = (pagesize - padsize) % pagesize;
+    slice_size = slice_size + padsize;
 
-    alloc_size = sizeOfRegion + padsize;
+    /* And may grow to an equal share of the maximum footprint */
+    stride = (max_footprint + arena_count - 1) / arena_count;
+    padsize = stride % pagesize;
+    padsize = (pagesize - padsize) % pagesize;
+    stride = stride + padsize;
+    if (stride < slice_size)
+    {
+        stride = slice_size;
+    }
+
+    if (stride > MEM_MAX_REGION / arena_count)
+    {
+        fprintf(stderr, "Error:mem.c: Requested block size is too large\n");
+        return -1;
+    }
 
     /* Using mmap to allocate memory */
     fd = open("/dev/zero", O_RDWR);
@@ -93,26 +419,205 @@ int Mem_Init(int sizeOfRegion, int policy)
         fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
         return -1;
     }
-    space_ptr = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    zero_fd = fd;
+    reserve = stride * arena_count;
+    space_ptr = mmap(NULL, reserve + pagesize, PROT_NONE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
     if (MAP_FAILED == space_ptr)
     {
         fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
-        allocated_once = 0;
+        initUndo(0, stride);
         return -1;
     }
+    /* Start on a multiple of pagesize, a huge page for huge pages, and give */
+    /* back the slack on both sides */
+    padsize = ((unsigned long)space_ptr) % pagesize;
+    padsize = (pagesize - padsize) % pagesize;
+    if (padsize > 0)
+    {
+        munmap(space_ptr, padsize);
+    }
+    munmap((char *)space_ptr + padsize + reserve, pagesize - padsize);
+    space_ptr = (char *)space_ptr + padsize;
+
+    region_base = (char *)space_ptr;
+    for (int i = 0; i < arena_count; i++)
+    {
+        mem_arena *arena = &arenas[i];
+
+        memset(arena, 0, sizeof(mem_arena));
+        pthread_mutex_init(&arena->lock, NULL);
+        arena->fit = policy;
+        arena->region_start = (char *)space_ptr + i * stride;
+        arena->region_end = arena->region_start + slice_size;
+
+        /* Worst fit keeps its priority queue next to the region */
+        if (mapChunk(arena->region_start, slice_size) != 0
+            || slabSetup(arena, stride, fd) != 0
+            || (policy == 2 && heapSetup(arena, stride, fd) != 0))
+        {
+            fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
+            initUndo(i + 1, stride);
+            munmap(space_ptr, reserve);
+            region_base = NULL;
+            return -1;
+        }
+
+        arenaFormat(arena);
+    }
 
     allocated_once = 1;
+    arena_stride = stride;
+    forkRegister();
 
-    /* To begin with, there is only one big, free block */
-    list_head = (block_header *)space_ptr;
-    list_head->next = NULL;
+    /* A trace can be asked for without touching the program, see Mem_Trace */
+    char *trace_path = getenv("MEM_TRACE");
+    if (trace_path != NULL && Mem_Trace(trace_path) != 0)
+    {
+        fprintf(stderr, "Error:mem.c: Cannot create trace %s\n", trace_path);
+    }
+    return 0;
+}
+
+/* Lays out an arena with empty free indexes as it is before the first */
+/* allocation: one big free block, or the buddy blocks after the lead block, */
+/* followed by the fence that closes the arena */
+void arenaFormat(mem_arena *arena)
+{
+    block_header *fence = (block_header *)arena->region_end - 1;
+    setFence(arena, fence);
+    arena->list_head = (block_header *)(arena->region_start + SIZE_BIAS);
+    arena->clean = (char *)(arena->list_head + 1);
+    if (arena->fit == 4)
+    {
+        /* The buddy system starts after a lead block, see buddyBase() */
+        char *first = buddyBase(arena) + BUDDY_MIN_BLOCK;
+        setNext(arena->list_head, (block_header *)first);
+        setSize(arena->list_head, first - (char *)(arena->list_head + 1), 0);
+        setMagic(arena, arena->list_head);
+        setFooter(arena->list_head);
+        /* Nothing can use it, it counts as free like Mem_Dump shows it */
+        arena->free_bytes = getSize(arena->list_head);
+        arena->free_blocks = 1;
+        buddyExtend(arena, first, (char *)fence, PREV_FREE);
+        return;
+    }
+    setNext(arena->list_head, fence);
     /* Remember that the 'size' stored in block size excludes the space for the header */
-    list_head->size_status = alloc_size - (int)sizeof(block_header);
-    fit = policy;
-    // allocsize = list_head->size_status;
+    setSize(arena->list_head, arena->region_end - arena->region_start - SIZE_BIAS
+        - 2 * (long)sizeof(block_header), 0);
+    setMagic(arena, arena->list_head);
+    setFooter(arena->list_head);
+    fence->size_status |= PREV_FREE;
+    insertFree(arena, arena->list_head);
+}
+
+/* Unit the region is mapped in: a page, or a huge page with MEM_OPT_HUGE_PAGES */
+long mapGranule()
+{
+    return huge_pages ? HUGE_PAGE_SIZE : getpagesize();
+}
+
+/* Maps 'length' bytes of zeroed memory at 'addr', inside the reserved region */
+/* Pages are only backed once touched, so a heap of many GiB is not charged up */
+/* front. With MEM_OPT_HUGE_PAGES the kernel is asked to back it with huge pages; */
+/* it is free to refuse, Mem_Dump shows what was actually obtained */
+/* Returns 0 on success and -1 on failure */
+int mapChunk(char *addr, long length)
+{
+    void *space_ptr = mmap(addr, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_FIXED | MAP_NORESERVE, zero_fd, 0);
+    if (MAP_FAILED == space_ptr)
+    {
+        return -1;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages)
+    {
+        madvise(space_ptr, length, MADV_HUGEPAGE);
+    }
+#endif
     return 0;
 }
 
+/* Undoes a Mem_Init that failed after opening /dev/zero: the tables of the */
+/* first 'count' arenas are unmapped and the settings go back to what they */
+/* were before Mem_Init, a single arena included. The caller unmaps the region */
+void initUndo(int count, long stride)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (arenas[i].slab_map != NULL)
+        {
+            munmap(arenas[i].slab_map, stride / SLAB_SIZE + 1);
+        }
+        if (arenas[i].heap_array != NULL)
+        {
+            munmap(arenas[i].heap_array, heapCapacity(stride) * sizeof(block_header *));
+        }
+        pthread_mutex_destroy(&arenas[i].lock);
+    }
+    memset(arenas, 0, count * sizeof(mem_arena));
+    close(zero_fd);
+    zero_fd = -1;
+    arena_count = 1;
+}
+
+/* Bytes of the region backed by transparent huge pages, as /proc/self/smaps */
+/* reports them, or -1 when it cannot be read */
+long hugePageBytes()
+{
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    char line[256];
+    unsigned long start, end;
+    unsigned long region_limit = (unsigned long)region_base + arena_stride * arena_count;
+    int inside = 0;
+    long kb;
+    long total = 0;
+
+    if (smaps == NULL)
+    {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), smaps) != NULL)
+    {
+        //Every mapping starts with its address range, its counters follow
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+        {
+            inside = start < region_limit && end > (unsigned long)region_base;
+        }
+        else if (inside && sscanf(line, "AnonHugePages: %ld kB", &kb) == 1)
+        {
+            total = total + kb * 1024;
+        }
+    }
+    fclose(smaps);
+    return total;
+}
+
+/* Arena owning 'ptr', or NULL when ptr is outside the region */
+mem_arena *getArena(void *ptr)
+{
+    char *math_pointer = (char *)ptr;
+    if (math_pointer < region_base
+        || math_pointer >= region_base + arena_stride * arena_count)
+    {
+        return NULL;
+    }
+    return &arenas[(math_pointer - region_base) / arena_stride];
+}
+
+/* Arena of the calling thread, assigned round-robin on first use */
+mem_arena *threadArena()
+{
+    if (thread_arena == NULL)
+    {
+        int i = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED);
+        thread_arena = &arenas[i % arena_count];
+    }
+    return thread_arena;
+}
+
 int isFree(block_header *ptr)
 {
     //If size status is even then it is free
@@ -142,671 +647,4661 @@ void setAllocated(block_header *ptr)
     }
 }
 
-/* Function for allocating 'size' bytes. */
-/* Returns address of allocated block on success */
-/* Returns NULL on failure */
-/* Here is what this function should accomplish */
-/* - Check for sanity of size - Return NULL when appropriate */
-/* - Round up size to a multiple of 4 */
-/* - Traverse the list of blocks and allocate the best free block which can accommodate the requested size */
-/* -- Also, when allocating a block - split it into two blocks when possible */
-/* Tips: Be careful with pointer arithmetic */
-void *Mem_Alloc(int size)
+/* Header cookie */
+/* Only block headers written by the allocator carry the cookie of their address. */
+/* A pointer into the middle of a payload (or a header swallowed by coalescing, */
+/* which gets its cookie wiped) fails the check in constant time. The reset */
+/* generation of the arena is mixed in, so the headers left behind by */
+/* Mem_HeapReset fail it too. Direct mappings have no arena and use 0. */
+/* The cookie lives in the top MAGIC_BITS of size_status, compact headers have none */
+#define BLOCK_MAGIC 0x5a3c96e1
+#define MAGIC_SHIFT 40
+#define MAGIC_BITS 24
+
+unsigned long blockMagic(mem_arena *arena, block_header *ptr)
 {
-    /** Checking for Sanity
-     * 1. Cannot allocate memory if size requested is non positive
-     * 2. Cannot alloctae memory if no memory is left
-    */
-    if (size <= 0)// || size > list_head->size_status)
-    {
-        return NULL;
-    }
-
-
-    //Round up size to be divisible by 4
-    if (size % 4 != 0)
-    {
-        size = (size | 0x03) + 1;
-    }
+    unsigned long addr = (unsigned long)ptr;
+    unsigned long generation = arena != NULL ? arena->generation : 0;
+    return (BLOCK_MAGIC ^ (addr >> 4) ^ (addr >> 28) ^ generation) & ((1UL << MAGIC_BITS) - 1);
+}
 
-    //Regardless of policy head initialization is gonna be the same
-    //Allocate head
-    if (list_head->next == NULL)
-    {
+/* Status bits and size, ie size_status without the cookie */
+#ifdef MEM_COMPACT_HEADER
+#define SIZE_STATUS_MASK (~0U)
+#else
+#define SIZE_STATUS_MASK ((1UL << MAGIC_SHIFT) - 1)
+#endif
 
-        void *temp_pointer = (void *)list_head;
-        int size_head = list_head->size_status;
-        block_header *new_block = (block_header *)(temp_pointer +
-            size + sizeof(block_header));
-        size += 0x1; // indicate block is in use
-        list_head->size_status = size;
+void setMagic(mem_arena *arena, block_header *ptr)
+{
+#ifndef MEM_COMPACT_HEADER
+    ptr->size_status = (ptr->size_status & SIZE_STATUS_MASK) | (blockMagic(arena, ptr) << MAGIC_SHIFT);
+#else
+    (void)arena;
+    (void)ptr;
+#endif
+}
 
-        //Link the blocks
-        list_head->next = new_block;
-        new_block->next = NULL;
-        new_block->size_status = size_head - sizeof(block_header) - size + 1;
-        // void *math_pointer1 = (void *)list_head;
-        // void *math_pointer2 = (void *)list_head->next;
-        // printf("----||%d|||-----\n", math_pointer2 - math_pointer1);
-        return list_head + 1;
-    }
+/* Every arena ends with a fence: a busy block of size 0 in its last bytes */
+/* It keeps the last real block from coalescing past the end of the mapped */
+/* memory, and carries PREV_FREE for it, so growArena knows whether new memory */
+/* has to be merged into a free block. Mem_Dump does not show it. */
+void setFence(mem_arena *arena, block_header *ptr)
+{
+    setNext(ptr, NULL);
+    setSize(ptr, 0, 0x01);
+    setMagic(arena, ptr);
+}
 
-    switch (fit)
-    {
-    case 0: { //When a best fit Policy is followed
-        /**
-         * In this policy:
-         * 1. Start at head and traverse the list to see size
-         * 2. make array of that size
-         * 3. input sizes into that array.
-        */
-        int array_size = 0;
-        block_header *counter = list_head;
-        while (counter != NULL)
-        {
-            array_size++;
-            counter = counter->next;
-        }
-        int array_list[array_size];
-        //fill the array
-        counter = list_head;
-        int j =0;
-        while (counter != NULL)
-        {
-            array_list[j] = counter->size_status;
-            counter = counter->next;
-            j++;
-        }
+/* Size of the block without the status bits */
+long getSize(block_header *ptr)
+{
+    return (long)(ptr->size_status & SIZE_STATUS_MASK & ~(MEM_ALIGN - 1)) - SIZE_BIAS;
+}
 
-        //Of the array Elements find the min even number
-        int min = -1;
-        //Assign min a number
-        for (int i = 0; i < array_size; i++) {
-            if ((array_list[i] % 2 ==0)) {
-                min = array_list[i];
-                break;
-            }
-        }
-        if (min == -1) {//No space in array
-            return NULL;
-        }
+/* Stores 'size' along with the status bits 'flags', keeping the cookie */
+void setSize(block_header *ptr, long size, int flags)
+{
+    ptr->size_status = (ptr->size_status & ~SIZE_STATUS_MASK) | (size + SIZE_BIAS) | flags;
+}
 
-        //Search for smallest min
+block_header * getNext(block_header * node) {
+    return node->next == 0 ? NULL : (block_header *)((char *)node + node->next);
+}
 
-        for (int i = 0; i < array_size; i++) {
-            if ((array_list[i] % 2 ==0) && array_list[i] < min
-                && min >= size) {
-                min = array_list[i];
-            }
-        }
+void setNext(block_header *node, block_header *next) {
+    node->next = next == NULL ? 0 : (char *)next - (char *)node;
+}
 
+/* Boundary tags */
+/* A free block stores the address of its own header in the last word of its payload */
+/* (the footer), and the block right after it has PREV_FREE set in size_status. */
+/* Mem_Free can then reach both physical neighbours in constant time: the next one */
+/* through 'next', the previous one through the footer just below its own header. */
+/* Allocated blocks carry no footer, so the tags cost nothing for busy memory. */
+block_header **getFooter(block_header *ptr)
+{
+    return (block_header **)((char *)(ptr + 1) + getSize(ptr)) - 1;
+}
 
-        //Placement obtained based on min & size;
-        //Placement obtained - Decide splitting 
-        int demand = size;
-        int available = min;
-        if (demand == available) {//The requirement is an exact fit
-        //filter through list for that position and allocate
-            counter = list_head;
-            while (counter != NULL) {
-                if (counter->size_status == size) {
-                    //Required position found
-                    //Allocate space
-                    size += 0x1; // indicate block is in use
-                    counter->size_status = size;
-                    return counter + 1;
-                }
-                counter = counter->next;
-            }
+void setFooter(block_header *ptr)
+{
+    *getFooter(ptr) = ptr;
+}
 
-        }
-        else if (available < (demand + sizeof(list_head) + sizeof(list_head)/2)) {
-            //Not enough space to spill, enough to allocate
-            //size += 0x1; // indicate block is in use
+/* The links live in the payload of a free block, right after its header */
+/* Only one policy is active at a time, so their layouts share the same bytes */
+typedef union free_hd
+{
+    /* TLSF (policy 3) and buddy system (policy 4): doubly linked per-class */
+    /* or per-order list */
+    struct
+    {
+        block_header *prev_free;
+        block_header *next_free;
+    } list;
+    /* Best fit (policy 0): treap ordered by (size, address) */
+    struct
+    {
+        block_header *left;
+        block_header *right;
+    } tree;
+    /* Worst fit (policy 2): position in the max-heap array */
+    struct
+    {
+        long index;
+    } heap;
+} free_links;
 
+/* Every block has to be able to hold the free links and the footer once it is freed */
+#define MIN_BLOCK_SIZE ((long)((sizeof(free_links) + sizeof(block_header *) + SIZE_BIAS \
+    + MEM_ALIGN - 1) & ~(MEM_ALIGN - 1)) - SIZE_BIAS)
 
-            counter = list_head;
-            while (counter != NULL) {
+free_links *getLinks(block_header *ptr)
+{
+    return (free_links *)(ptr + 1);
+}
 
-                if (counter->size_status == size) {
-                    //Required position found
-                    //Allocate space
-                    size += 0x1; // indicate block is in use
-                    counter->size_status = counter->size_status + 1;
-                    return counter + 1;
-                }
-                counter = counter->next;
-            }
+/* TLSF (policy 3) operations, see the TLSF_* parameters at the top */
 
+/* Index of the most significant set bit, x must not be 0 */
+int tlsfFls(unsigned long x)
+{
+    return 63 - __builtin_clzl(x);
+}
 
-        }
-        else {
+/* Index of the least significant set bit, x must not be 0 */
+int tlsfFfs(unsigned int x)
+{
+    return __builtin_ctz(x);
+}
 
-            //Enough space for splitting
-            //Process of splitting
-            counter = list_head;
-            while (counter != NULL) {
-                if (counter->size_status == min) {
-                    // printf("--------mEEEEEEEEEE123------\n");
-                    // printf("--------min:%d------\n", size);
-                    //If block found do the process of splitting
-                    void *temp_pointer = (void *)counter;
-                    int size_counter = counter->size_status;
-                    block_header *new_block = (block_header *)(temp_pointer +
-                        size + sizeof(block_header));
-                    size += 0x1; // indicate block is in use
-                    counter->size_status = size;
-                    //Link the blocks
-                    block_header *next_block = counter->next;
-                    counter->next = new_block;
-                    //Two conditions-may be at end of list
-                    //1. new block is last block
-                    //2. new block in middle
-                    if (next_block == NULL) {//End of list
-                        // printf("-------------MEE---------\n");
-                        // printf("----------%d------------\n", size_counter);
-                        new_block->next=NULL;
-                        new_block->size_status = size_counter -
-                            sizeof(block_header) - (size-1);
-                        return counter + 1;
-                    }
-                    else { //Not end of list
-                    //Check after remove()!!!!!
-                       // printf("-------------MEE!!!---------\n");
-                        new_block->next = counter->next;
-                        void *start_p = (void *)counter;
-                        void *end_p = (void *)counter->next;
-                        new_block->size_status = (end_p - start_p) -
-                            2*sizeof(block_header) - (size-1);
-                        return counter + 1;
-                    }
+/* Computes the (fl, sl) class a block of exactly 'size' bytes belongs to */
+void tlsfMapping(long size, int *fl, int *sl)
+{
+    if (size < (1 << TLSF_FL_SHIFT))
+    {
+        *fl = 0;
+        *sl = (int)(size / (1 << (TLSF_FL_SHIFT - TLSF_SL_LOG)));
+    }
+    else
+    {
+        int f = tlsfFls(size);
+        *sl = (int)(size >> (f - TLSF_SL_LOG)) ^ TLSF_SL_COUNT;
+        *fl = f - TLSF_FL_SHIFT + 1;
+    }
+}
 
-                }
+void tlsfInsert(mem_arena *arena, block_header *ptr)
+{
+    int fl, sl;
+    tlsfMapping(getSize(ptr), &fl, &sl);
+    block_header *head = arena->tlsf_free[fl][sl];
+    getLinks(ptr)->list.prev_free = NULL;
+    getLinks(ptr)->list.next_free = head;
+    if (head != NULL)
+    {
+        getLinks(head)->list.prev_free = ptr;
+    }
+    arena->tlsf_free[fl][sl] = ptr;
+    arena->tlsf_fl_bitmap |= 1U << fl;
+    arena->tlsf_sl_bitmap[fl] |= 1U << sl;
+}
 
-                counter = counter->next;
+void tlsfRemove(mem_arena *arena, block_header *ptr)
+{
+    int fl, sl;
+    tlsfMapping(getSize(ptr), &fl, &sl);
+    block_header *prev = getLinks(ptr)->list.prev_free;
+    block_header *next = getLinks(ptr)->list.next_free;
+    if (next != NULL)
+    {
+        getLinks(next)->list.prev_free = prev;
+    }
+    if (prev != NULL)
+    {
+        getLinks(prev)->list.next_free = next;
+    }
+    else
+    {
+        arena->tlsf_free[fl][sl] = next;
+        if (next == NULL)
+        {
+            arena->tlsf_sl_bitmap[fl] &= ~(1U << sl);
+            if (arena->tlsf_sl_bitmap[fl] == 0)
+            {
+                arena->tlsf_fl_bitmap &= ~(1U << fl);
             }
-
         }
+    }
+}
 
-
-
-
-
-
-        break;}
-    case 1: {
-        //When a policy of First Fit is followed
-            /**
-             * In this policy:
-             * 1. Start at head and traverse the list
-             * 2. if a good spot is found see if it can be split
-             * 3. if yes split (space for head and atleast 4bytes)-return
-             * 4. if not alloc whole space-retun
-            */
-            //Step1:
-        block_header *counter = list_head;
-        while (counter != NULL)
+/* Returns a free block of at least 'size' bytes or NULL, in constant time */
+/* The size is rounded up to the next class boundary first so that every block */
+/* in the class found is guaranteed to fit (good-fit rather than best-fit) */
+block_header *tlsfFind(mem_arena *arena, long size)
+{
+    int fl, sl;
+    if (size >= (1 << TLSF_FL_SHIFT))
+    {
+        long round = (1L << (tlsfFls(size) - TLSF_SL_LOG)) - 1;
+        if (size >= MEM_MAX_REGION - round)
         {
+            return NULL;
+        }
+        size += round;
+    }
+    tlsfMapping(size, &fl, &sl);
 
-            //Step2-check for spot
-            // if ()
-            // {
-            //     /* code */
-            // }
-            if (isFree(counter) && (counter->size_status == size)) {
-               // printf("-----i was called----\n");
-                size += 0x1; // indicate block is in use
-                counter->size_status = size;
-                return counter + 1;
-
-            }
-
+    unsigned int sl_map = arena->tlsf_sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0)
+    {
+        /* Nothing left on this level, take the smallest non-empty bigger level */
+        unsigned int fl_map = fl + 1 < TLSF_FL_COUNT ? arena->tlsf_fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (fl_map == 0)
+        {
+            return NULL;
+        }
+        fl = tlsfFfs(fl_map);
+        sl_map = arena->tlsf_sl_bitmap[fl];
+    }
+    sl = tlsfFfs(sl_map);
+    return arena->tlsf_free[fl][sl];
+}
 
-            if (isFree(counter) && (counter->size_status > size)) {
-                //Step3-Check if it can be split
-                //it can be split if it can accomodate atleast
-                //size + one head + 0.5 head min size 4
-                int demand = size;
-                int available = counter->size_status;
-                int pinch = available - demand;
-
-                if (counter->size_status >=  size + sizeof(block_header)
-                    + sizeof(block_header)/2) {
-                    //Continue spliting 
-                    void *temp_pointer = (void *)counter;
-                    int size_counter = counter->size_status;
-                    block_header *new_block = (block_header *)(temp_pointer +
-                        size + sizeof(block_header));
-                    size += 0x1; // indicate block is in use
-                    counter->size_status = size;
-                    //Link the blocks
-                    block_header *next_block = counter->next;
-                    counter->next = new_block;
-                    //Two conditions-may be at end of list
-                    //1. new block is last block
-                    //2. new block in middle
-                    if (next_block == NULL) {//End of list
-                        // printf("-------------MEE---------\n");
-                        // printf("----------%d------------\n", size_counter);
-                        new_block->next=NULL;
-                        new_block->size_status = size_counter -
-                            sizeof(block_header) - (size-1);
-                        return counter + 1;
-                    }
-                    else { //Not end of list
-                    //Check after remove()!!!!!
-                        // printf("-------------MEE!!!---------\n");
-                        new_block->next = counter->next;
-                        void *start_p = (void *)counter;
-                        void *end_p = (void *)counter->next;
-                        new_block->size_status = (end_p - start_p) -
-                            2*sizeof(block_header) - (size-1);
-                        return counter + 1;
-                    }
+/* Size-ordered index for best fit (policy 0) */
+/* Free blocks form a treap keyed by (size, address): a binary search tree on the */
+/* key that is also a max-heap on a priority hashed from the block address. The */
+/* random-looking priorities keep the expected depth logarithmic without storing */
+/* any balance information, so a node is just the two child links. Insert and */
+/* remove are iterative split/merge operations. */
+#define treeLeft(ptr) (getLinks(ptr)->tree.left)
+#define treeRight(ptr) (getLinks(ptr)->tree.right)
 
-                }
-                //Just allocate without splitting
-                //Two conditions when thats possible
-                //demand== available
-                // else if (isFree(counter) && (counter->size_status >= size) &&
-                //     (counter->size_status ==  size + sizeof(block_header)
-                //         + sizeof(block_header)/2)) {
-                //     printf("-------------MEE-yoo--------\n");
-
-
-                //     size += 0x1; // indicate block is in use
-                //     counter->size_status = size;
-                //     return counter + 1;
-                // }
-                //pinch = avialable - demand
-                //pinch<12 && pinch > 0
-                // available = counter->size_status
-                //This cannnot be allowed to happen on the last block
-
-                else if (isFree(counter) && available > demand && pinch >0
-                    && pinch < 12 && counter->next != NULL) {
-                    // printf("-------------MEE-yoo-pinch=%d-------\n", pinch);
-                    // printf("-------------MEE-yoo-available=%d-------\n", available);
-
-
-                    size += 0x1; // indicate block is in use
-                    counter->size_status = counter->size_status + 1;
-                    return counter + 1;
-                }
+unsigned int treePriority(block_header *ptr)
+{
+    return (unsigned int)((unsigned long)ptr >> 2) * 2654435761U;
+}
 
+/* Strict (size, address) order, ties on size go to the lower address */
+int treeLess(block_header *a, block_header *b)
+{
+    long size_a = getSize(a);
+    long size_b = getSize(b);
+    return size_a < size_b || (size_a == size_b && a < b);
+}
 
+void treeInsert(mem_arena *arena, block_header *ptr)
+{
+    unsigned int priority = treePriority(ptr);
+    block_header **link = &arena->tree_root;
 
+    //Walk down while the existing nodes outrank the new one
+    while (*link != NULL && treePriority(*link) > priority)
+    {
+        link = treeLess(ptr, *link) ? &treeLeft(*link) : &treeRight(*link);
+    }
 
-            }
-            // else{
-            //     printf("here");
+    //Split the subtree hanging there into keys below and above ptr
+    block_header *rest = *link;
+    block_header **less = &treeLeft(ptr);
+    block_header **more = &treeRight(ptr);
+    while (rest != NULL)
+    {
+        if (treeLess(rest, ptr))
+        {
+            *less = rest;
+            less = &treeRight(rest);
+            rest = treeRight(rest);
+        }
+        else
+        {
+            *more = rest;
+            more = &treeLeft(rest);
+            rest = treeLeft(rest);
+        }
+    }
+    *less = NULL;
+    *more = NULL;
+    *link = ptr;
+}
 
-            // }
+void treeRemove(mem_arena *arena, block_header *ptr)
+{
+    block_header **link = &arena->tree_root;
+    while (*link != ptr)
+    {
+        link = treeLess(ptr, *link) ? &treeLeft(*link) : &treeRight(*link);
+    }
 
-            counter = counter->next;
-        }
-        //If it traversed through the entire list and couldnt find a place
-        //Then size > any free slot. In which case return NULL
-        //Sanity check Part 2
-        return NULL;
-        break;}
-    case 2: { //When a worst fit Policy is followed
-        int array_size = 0;
-        block_header *counter = list_head;
-        while (counter != NULL)
+    //Merge the two subtrees of ptr into its place
+    block_header *left = treeLeft(ptr);
+    block_header *right = treeRight(ptr);
+    while (left != NULL && right != NULL)
+    {
+        if (treePriority(left) > treePriority(right))
         {
-            array_size++;
-            counter = counter->next;
+            *link = left;
+            link = &treeRight(left);
+            left = treeRight(left);
         }
-        int array_list[array_size];
-        //fill the array
-        counter = list_head;
-        int j =0;
-        while (counter != NULL)
+        else
         {
-            array_list[j] = counter->size_status;
-            counter = counter->next;
-            j++;
+            *link = right;
+            link = &treeLeft(right);
+            right = treeLeft(right);
         }
+    }
+    *link = (left != NULL) ? left : right;
+}
 
-        int max = -1;
-        //Assign min a number
-        for (int i = 0; i < array_size; i++) {
-            if ((array_list[i] % 2 ==0)) {
-                max = array_list[i];
-                break;
+/* Smallest free block of at least 'size' bytes, or NULL */
+block_header *treeFind(mem_arena *arena, long size)
+{
+    block_header *best = NULL;
+    block_header *node = arena->tree_root;
+    while (node != NULL)
+    {
+        arena->walk_steps++;
+        if (getSize(node) >= size)
+        {
+            best = node;
+            node = treeLeft(node);
+        }
+        else
+        {
+            node = treeRight(node);
+        }
+    }
+    return best;
+}
+
+/* Priority queue for worst fit (policy 2) */
+/* Free blocks sit in a binary max-heap on their size, stored as an array of */
+/* headers mapped next to the region. Each free block remembers its slot, so */
+/* coalescing can pull an arbitrary neighbour out in O(log n), and the largest */
+/* block is always arena->heap_array[0]. */
+#define heapIndex(ptr) (getLinks(ptr)->heap.index)
+
+/* Slots of the heap array of a region of 'region_size' bytes */
+long heapCapacity(long region_size)
+{
+    return region_size / ((long)sizeof(block_header) + MIN_BLOCK_SIZE) + 1;
+}
+
+/* Maps the heap array, big enough for every free block the region can hold */
+int heapSetup(mem_arena *arena, long region_size, int fd)
+{
+    void *space_ptr = mmap(NULL, heapCapacity(region_size) * sizeof(block_header *),
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (MAP_FAILED == space_ptr)
+    {
+        return -1;
+    }
+    arena->heap_array = (block_header **)space_ptr;
+    arena->heap_count = 0;
+    return 0;
+}
+
+void heapPlace(mem_arena *arena, block_header *ptr, long i)
+{
+    arena->heap_array[i] = ptr;
+    heapIndex(ptr) = i;
+}
+
+void heapSiftUp(mem_arena *arena, long i)
+{
+    block_header *ptr = arena->heap_array[i];
+    long size = getSize(ptr);
+    while (i > 0)
+    {
+        long parent = (i - 1) / 2;
+        if (getSize(arena->heap_array[parent]) >= size)
+        {
+            break;
+        }
+        heapPlace(arena, arena->heap_array[parent], i);
+        i = parent;
+    }
+    heapPlace(arena, ptr, i);
+}
+
+void heapSiftDown(mem_arena *arena, long i)
+{
+    block_header *ptr = arena->heap_array[i];
+    long size = getSize(ptr);
+    while (2 * i + 1 < arena->heap_count)
+    {
+        long child = 2 * i + 1;
+        if (child + 1 < arena->heap_count
+            && getSize(arena->heap_array[child + 1]) > getSize(arena->heap_array[child]))
+        {
+            child++;
+        }
+        if (getSize(arena->heap_array[child]) <= size)
+        {
+            break;
+        }
+        heapPlace(arena, arena->heap_array[child], i);
+        i = child;
+    }
+    heapPlace(arena, ptr, i);
+}
+
+void heapInsert(mem_arena *arena, block_header *ptr)
+{
+    arena->heap_array[arena->heap_count] = ptr;
+    arena->heap_count++;
+    heapSiftUp(arena, arena->heap_count - 1);
+}
+
+void heapRemove(mem_arena *arena, block_header *ptr)
+{
+    long i = heapIndex(ptr);
+    arena->heap_count--;
+    if (i == arena->heap_count)
+    {
+        return;
+    }
+    //Fill the hole with the last entry and let it settle either way
+    block_header *last = arena->heap_array[arena->heap_count];
+    heapPlace(arena, last, i);
+    heapSiftUp(arena, i);
+    heapSiftDown(arena, heapIndex(last));
+}
+
+/* The largest free block if it fits 'size' bytes, or NULL */
+block_header *heapFind(mem_arena *arena, long size)
+{
+    if (arena->heap_count == 0 || getSize(arena->heap_array[0]) < size)
+    {
+        return NULL;
+    }
+    return arena->heap_array[0];
+}
+
+/* Free lists of the buddy system (policy 4), see the BUDDY_* parameters at the top */
+
+/* Buddy offsets count from one header below the region, so the payload of a */
+/* block of 2^k bytes is aligned to 2^k, or to the alignment of the region if */
+/* that is less. The block at offset 0 would have its header outside the */
+/* region, so an arena starts with a lead block that pads it up to offset */
+/* BUDDY_MIN_BLOCK. The lead is marked free but sits on no list. */
+char *buddyBase(mem_arena *arena)
+{
+    return arena->region_start - sizeof(block_header);
+}
+
+/* Order of the smallest buddy block of at least 'bytes' bytes, header included */
+int buddyOrder(long bytes)
+{
+    if (bytes <= BUDDY_MIN_BLOCK)
+    {
+        return BUDDY_MIN_ORDER;
+    }
+    return tlsfFls((unsigned long)(bytes - 1)) + 1;
+}
+
+/* Payload of the buddy block that serves a request of 'size' bytes */
+long buddySize(long size)
+{
+    return (1L << buddyOrder(size + (long)sizeof(block_header))) - (long)sizeof(block_header);
+}
+
+void buddyInsert(mem_arena *arena, block_header *ptr)
+{
+    int k = tlsfFls(getSize(ptr) + sizeof(block_header));
+    block_header *head = arena->buddy_free[k];
+    getLinks(ptr)->list.prev_free = NULL;
+    getLinks(ptr)->list.next_free = head;
+    if (head != NULL)
+    {
+        getLinks(head)->list.prev_free = ptr;
+    }
+    arena->buddy_free[k] = ptr;
+    arena->buddy_bitmap |= 1UL << k;
+}
+
+void buddyRemove(mem_arena *arena, block_header *ptr)
+{
+    int k = tlsfFls(getSize(ptr) + sizeof(block_header));
+    block_header *prev = getLinks(ptr)->list.prev_free;
+    block_header *next = getLinks(ptr)->list.next_free;
+    if (next != NULL)
+    {
+        getLinks(next)->list.prev_free = prev;
+    }
+    if (prev != NULL)
+    {
+        getLinks(prev)->list.next_free = next;
+    }
+    else
+    {
+        arena->buddy_free[k] = next;
+        if (next == NULL)
+        {
+            arena->buddy_bitmap &= ~(1UL << k);
+        }
+    }
+}
+
+/* A free block of the smallest non-empty order that holds 'size' bytes, or NULL */
+block_header *buddyFind(mem_arena *arena, long size)
+{
+    int k = buddyOrder(size + (long)sizeof(block_header));
+    if (k >= BUDDY_ORDERS)
+    {
+        return NULL;
+    }
+    unsigned long orders = arena->buddy_bitmap & ~((1UL << k) - 1);
+    if (orders == 0)
+    {
+        return NULL;
+    }
+    return arena->buddy_free[__builtin_ctzl(orders)];
+}
+
+/* Files a free block in the index of the current policy */
+/* First-fit searches the block list itself */
+void insertFree(mem_arena *arena, block_header *ptr)
+{
+    arena->free_bytes = arena->free_bytes + getSize(ptr);
+    arena->free_blocks++;
+    if (arena->fit == 0)
+    {
+        treeInsert(arena, ptr);
+    }
+    else if (arena->fit == 2)
+    {
+        heapInsert(arena, ptr);
+    }
+    else if (arena->fit == 3)
+    {
+        tlsfInsert(arena, ptr);
+    }
+    else if (arena->fit == 4)
+    {
+        buddyInsert(arena, ptr);
+    }
+}
+
+/* Takes a free block out of the index of the current policy */
+void removeFree(mem_arena *arena, block_header *ptr)
+{
+    arena->free_bytes = arena->free_bytes - getSize(ptr);
+    arena->free_blocks--;
+    if (arena->fit == 0)
+    {
+        treeRemove(arena, ptr);
+    }
+    else if (arena->fit == 2)
+    {
+        heapRemove(arena, ptr);
+    }
+    else if (arena->fit == 3)
+    {
+        tlsfRemove(arena, ptr);
+    }
+    else if (arena->fit == 4)
+    {
+        buddyRemove(arena, ptr);
+    }
+}
+
+/* Turns the free block 'ptr' (already out of the free index) into a busy block */
+/* of 'size' bytes. The tail is split off as a new free block when it is big */
+/* enough to stand on its own, otherwise the whole block is handed out. */
+void splitBlock(mem_arena *arena, block_header *ptr, long size)
+{
+    long available = getSize(ptr);
+    if (arena->fit == 4)
+    {
+        //Buddy blocks are only ever halved
+        buddySplit(arena, ptr, size);
+        getNext(ptr)->size_status &= ~PREV_FREE;
+    }
+    else if (available >= size + (long)sizeof(block_header) + MIN_BLOCK_SIZE)
+    {
+        block_header *new_block = (block_header *)((char *)(ptr + 1) + size);
+        //The block after the tail still sees a free block before it
+        setNext(new_block, getNext(ptr));
+        setSize(new_block, available - size - (long)sizeof(block_header), 0);
+        setMagic(arena, new_block);
+        setNext(ptr, new_block);
+        setSize(ptr, size, ptr->size_status & PREV_FREE);
+        setFooter(new_block);
+        insertFree(arena, new_block);
+    }
+    else if (getNext(ptr) != NULL)
+    {
+        getNext(ptr)->size_status &= ~PREV_FREE;
+    }
+    setAllocated(ptr);
+}
+
+/* Finds a free block for 'size' bytes with the current policy and carves it */
+/* 'size' is already rounded, the caller holds the arena lock */
+/* Returns the busy block or NULL when nothing fits */
+block_header *allocBlock(mem_arena *arena, long size)
+{
+    block_header *found = NULL;
+    long steps = arena->walk_steps;
+
+    //Buddy blocks only come in powers of two
+    if (arena->fit == 4) {
+        size = buddySize(size);
+    }
+
+    //A freed block of just this size is still waiting, no search and no split
+    int i = quickClass(size);
+    if (i >= 0 && arena->quick[i] != NULL) {
+        arena->walk_calls++;
+        return quickPop(arena, i);
+    }
+
+    switch (arena->fit)
+    {
+    case 0: //When a best fit Policy is followed
+        //The smallest block that fits is the leftmost candidate in the size-ordered treap
+        found = treeFind(arena, size);
+        break;
+    case 1: {
+        //When a policy of First Fit is followed
+            /**
+             * In this policy:
+             * 1. Start at head and traverse the list
+             * 2. the first free block that is big enough is taken
+             * 3. splitBlock splits it if the rest can hold a block
+            */
+        block_header *counter = arena->list_head;
+        while (counter != NULL)
+        {
+            arena->walk_steps++;
+            if (isFree(counter) && getSize(counter) >= size) {
+                found = counter;
+                break;
+            }
+            counter = getNext(counter);
+        }
+        //If it traversed through the entire list and couldnt find a place
+        //Then size > any free slot. In which case return NULL
+        break;}
+    case 2: //When a worst fit Policy is followed
+        //The largest free block is always on top of the max-heap
+        found = heapFind(arena, size);
+        arena->walk_steps++;
+        break;
+    case 3: //TLSF keeps its own free lists, so it never walks the block list
+        found = tlsfFind(arena, size);
+        arena->walk_steps++;
+        break;
+    case 4: //The buddy system takes a block of the smallest order that fits and halves it
+        found = buddyFind(arena, size);
+        arena->walk_steps++;
+        break;
+    default:
+        break;
+    }
+
+    if (found == NULL && arena->quick_total > 0) {
+        //Merging the queued blocks may make room, the search is then retried
+        //and counted once, as part of this call
+        quickDrain(arena);
+        return allocBlock(arena, size);
+    }
+    arena->walk_calls++;
+    if (arena->walk_steps - steps > arena->walk_max) {
+        arena->walk_max = arena->walk_steps - steps;
+    }
+    if (found == NULL) {
+        return NULL;
+    }
+    removeFree(arena, found);
+    splitBlock(arena, found, size);
+    touchBlock(arena, found);
+    return found;
+}
+
+/* Moves the clean mark of 'arena' past the payload of 'ptr', which is handed out */
+void touchBlock(mem_arena *arena, block_header *ptr)
+{
+    char *end = (char *)(ptr + 1) + getSize(ptr);
+    if (end > arena->clean) {
+        arena->clean = end;
+    }
+}
+
+block_header * combine(block_header *p1, block_header *p2) {
+    //By-pass p2- Combine
+    setNext(p1, getNext(p2));
+    setSize(p1, getSize(p1) + (long)sizeof(block_header) + getSize(p2),
+        p1->size_status & (MEM_ALIGN - 1));
+    //p2 is payload now, its stale header must not pass as a block anymore
+    //Its header and links and the footer of a free p1 are wiped, which keeps
+    //free memory above the clean mark zero
+    memset(p2, 0, sizeof(block_header) + sizeof(free_links));
+    if (isFree(p1)) {
+        *((block_header **)p2 - 1) = NULL;
+    }
+    return p1;
+}
+
+void freeBlock(mem_arena *arena, block_header *req_pointer);
+
+/* Gives the tail of the busy block 'ptr' beyond 'size' bytes back to the arena */
+/* Nothing happens when the tail is too small to stand on its own */
+void trimBlock(mem_arena *arena, block_header *ptr, long size)
+{
+    long available = getSize(ptr);
+    if (arena->fit == 4)
+    {
+        //Upper halves go back for as long as the rest holds 'size' bytes
+        buddySplit(arena, ptr, size);
+        return;
+    }
+    if (available < size + (long)sizeof(block_header) + MIN_BLOCK_SIZE)
+    {
+        return;
+    }
+    block_header *tail = (block_header *)((char *)(ptr + 1) + size);
+    setNext(tail, getNext(ptr));
+    setSize(tail, available - size - (long)sizeof(block_header), 0x01);
+    setMagic(arena, tail);
+    setNext(ptr, tail);
+    setSize(ptr, size, ptr->size_status & (PREV_FREE | 0x01));
+    freeBlock(arena, tail);
+}
+
+/* Size of the block allocBlockAligned takes to carve 'size' bytes aligned to 'align' */
+/* The leading piece has to be able to stand on its own as a free block */
+long alignedRequest(long size, long align)
+{
+    return size + align + (long)sizeof(block_header) + MIN_BLOCK_SIZE;
+}
+
+/* Carves a busy block of 'size' bytes whose payload is aligned to 'align' */
+/* (a power of two). Takes a block with room to spare and frees the parts */
+/* before and after the aligned payload, so the padding is not lost */
+/* The caller holds the arena lock */
+/* Returns the busy block or NULL when nothing fits */
+block_header *allocBlockAligned(mem_arena *arena, long size, long align)
+{
+    long lead = (long)sizeof(block_header) + MIN_BLOCK_SIZE;
+    if (alignedRequest(size, align) > MEM_MAX_REGION)
+    {
+        return NULL;
+    }
+    if (arena->fit == 4)
+    {
+        return buddyAligned(arena, size, align);
+    }
+    block_header *ptr = allocBlock(arena, alignedRequest(size, align));
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
+
+    unsigned long payload = (unsigned long)(ptr + 1);
+    unsigned long aligned = (payload + lead + align - 1) & ~((unsigned long)align - 1);
+    if ((payload & (align - 1)) != 0)
+    {
+        block_header *moved = (block_header *)aligned - 1;
+        setNext(moved, getNext(ptr));
+        setSize(moved, getSize(ptr) - (long)(aligned - payload), 0x01);
+        setMagic(arena, moved);
+        setNext(ptr, moved);
+        setSize(ptr, (long)(aligned - payload - sizeof(block_header)),
+            ptr->size_status & (PREV_FREE | 0x01));
+        freeBlock(arena, ptr);
+        ptr = moved;
+    }
+    trimBlock(arena, ptr, size);
+    return ptr;
+}
+
+/* Carves a block with the default alignment or a stricter one */
+block_header *carveBlock(mem_arena *arena, long size, long align)
+{
+    if (align > MEM_ALIGN)
+    {
+        return allocBlockAligned(arena, size, align);
+    }
+    return allocBlock(arena, size);
+}
+
+/* Copy of the header 'ptr', read without the arena lock */
+/* Other threads may change the header meanwhile (a neighbour that is freed */
+/* sets PREV_FREE in it), so both fields are loaded atomically. Whatever is */
+/* decided on the copy is checked again under the lock before it counts */
+block_header loadHeader(block_header *ptr)
+{
+    block_header seen;
+    seen.next = __atomic_load_n(&ptr->next, __ATOMIC_RELAXED);
+    seen.size_status = __atomic_load_n(&ptr->size_status, __ATOMIC_RELAXED);
+    return seen;
+}
+
+/* Maps a pointer handed to Mem_Free back to its block header */
+/* Returns NULL when ptr is outside the arena, misaligned, or not the start of a block */
+block_header *getHeader(mem_arena *arena, void *ptr) {
+    char *math_pointer = (char *)ptr;
+
+    if (arena == NULL
+        || math_pointer < arena->region_start + sizeof(block_header)
+        || math_pointer >= arena->region_end) {
+        return NULL;
+    }
+    //Headers and payloads always start on a multiple of MEM_ALIGN from the region base
+    if ((math_pointer - arena->region_start) % MEM_ALIGN != 0) {
+        return NULL;
+    }
+    block_header *header = (block_header *)math_pointer - 1;
+    block_header seen = loadHeader(header);
+#ifndef MEM_COMPACT_HEADER
+    if ((seen.size_status >> MAGIC_SHIFT) != blockMagic(arena, header)) {
+        return NULL;
+    }
+#endif
+    //The link of a real header points right past its payload
+    //and a header swallowed by coalescing has been wiped
+    if ((long)seen.next != (long)sizeof(block_header) + getSize(&seen)) {
+        return NULL;
+    }
+    return header;
+}
+
+
+
+
+
+/* Marks the busy block 'req_pointer' free and merges it with its free neighbours */
+/* The caller holds the arena lock */
+void freeBlock(mem_arena *arena, block_header *req_pointer)
+{
+    if (arena->fit == 4) {
+        buddyFree(arena, req_pointer);
+        return;
+    }
+    setFree(req_pointer);
+
+    //Forward direction - the physical neighbour is simply the next block
+    block_header *next_pointer = getNext(req_pointer);
+    if (next_pointer != NULL && isFree(next_pointer)) {
+        removeFree(arena, next_pointer);
+        combine(req_pointer, next_pointer);
+    }
+
+    //Backward direction - a free neighbour left its address in its footer
+    if (req_pointer->size_status & PREV_FREE) {
+        block_header *prev_pointer = *((block_header **)req_pointer - 1);
+        removeFree(arena, prev_pointer);
+        req_pointer = combine(prev_pointer, req_pointer);
+    }
+
+    //Tag the merged block and let the next block know its neighbour is free
+    setFooter(req_pointer);
+    if (getNext(req_pointer) != NULL) {
+        getNext(req_pointer)->size_status |= PREV_FREE;
+    }
+    insertFree(arena, req_pointer);
+}
+
+/* Buddy blocks (policy 4) */
+/* Blocks are carved and freed in place like under the other policies, the */
+/* list of blocks and the boundary tags are kept up as usual, only the shapes */
+/* differ: a block is split into halves and merges with its buddy alone. */
+
+/* Halves the block 'ptr', busy or off its list, for as long as a half still */
+/* holds 'size' bytes. Every upper half becomes a free block */
+/* The caller holds the arena lock */
+void buddySplit(mem_arena *arena, block_header *ptr, long size)
+{
+    long block = getSize(ptr) + (long)sizeof(block_header);
+    long wanted = buddySize(size) + (long)sizeof(block_header);
+    while (block > wanted)
+    {
+        block = block / 2;
+        block_header *half = (block_header *)((char *)ptr + block);
+        setNext(half, getNext(ptr));
+        setSize(half, block - (long)sizeof(block_header), 0);
+        setMagic(arena, half);
+        setFooter(half);
+        getNext(half)->size_status |= PREV_FREE;
+        setNext(ptr, half);
+        setSize(ptr, block - (long)sizeof(block_header), ptr->size_status & (PREV_FREE | 0x01));
+        insertFree(arena, half);
+    }
+}
+
+/* Marks the busy block 'ptr' free and merges it with its buddy for as long */
+/* as the buddy is free and whole. The caller holds the arena lock */
+void buddyFree(mem_arena *arena, block_header *ptr)
+{
+    char *base = buddyBase(arena);
+    char *fence = arena->region_end - sizeof(block_header);
+    long block = getSize(ptr) + (long)sizeof(block_header);
+
+    setFree(ptr);
+    for (;;)
+    {
+        block_header *buddy = (block_header *)(base + (((char *)ptr - base) ^ block));
+        //There is no block at offset 0 and nothing past the fence, and a buddy
+        //that has been split has a smaller size in its header
+        if ((char *)buddy < base + BUDDY_MIN_BLOCK || (char *)buddy + block > fence
+            || !isFree(buddy) || getSize(buddy) != getSize(ptr))
+        {
+            break;
+        }
+        removeFree(arena, buddy);
+        ptr = buddy < ptr ? combine(buddy, ptr) : combine(ptr, buddy);
+        block = block * 2;
+    }
+    setFooter(ptr);
+    getNext(ptr)->size_status |= PREV_FREE;
+    insertFree(arena, ptr);
+}
+
+/* Hands the memory between the headers 'from' and 'to' (the fence) to the */
+/* buddy system as the largest aligned blocks that fit, each merged with its */
+/* buddy when that is free. 'flags' is the PREV_FREE bit of the first block */
+/* The caller holds the arena lock */
+void buddyExtend(mem_arena *arena, char *from, char *to, int flags)
+{
+    char *base = buddyBase(arena);
+    while (from < to)
+    {
+        long offset = from - base;
+        long block = offset & -offset;
+        while (block > to - from)
+        {
+            block = block / 2;
+        }
+        block_header *ptr = (block_header *)from;
+        setNext(ptr, (block_header *)(from + block));
+        setSize(ptr, block - (long)sizeof(block_header), flags | 0x01);
+        setMagic(arena, ptr);
+        buddyFree(arena, ptr);
+        flags = PREV_FREE;
+        from = from + block;
+    }
+}
+
+/* Carves a busy block of 'size' bytes whose payload is aligned to 'align' */
+/* Any block of at least 'align' bytes is, so one is taken and trimmed back */
+/* Alignments beyond that of the region itself fail */
+/* The caller holds the arena lock. Returns the busy block or NULL */
+block_header *buddyAligned(mem_arena *arena, long size, long align)
+{
+    long wanted = align - (long)sizeof(block_header);
+    block_header *ptr = allocBlock(arena, size > wanted ? size : wanted);
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
+    if (((unsigned long)(ptr + 1) & (align - 1)) != 0)
+    {
+        freeBlock(arena, ptr);
+        return NULL;
+    }
+    trimBlock(arena, ptr, size);
+    return ptr;
+}
+
+/* Grows the busy block 'ptr' in place to at least 'size' bytes by merging it */
+/* with its upper buddies, which all have to be free and whole */
+/* The caller holds the arena lock. Returns 0 on success and -1 otherwise */
+int buddyGrow(mem_arena *arena, block_header *ptr, long size)
+{
+    char *base = buddyBase(arena);
+    char *fence = arena->region_end - sizeof(block_header);
+    long block = getSize(ptr) + (long)sizeof(block_header);
+    long reach = block;
+
+    //Check all the way up first, a block that grew halfway would be no use
+    while (reach - (long)sizeof(block_header) < size)
+    {
+        block_header *buddy = (block_header *)((char *)ptr + reach);
+        if ((((char *)ptr - base) & reach) != 0 || (char *)buddy + reach > fence
+            || !isFree(buddy) || getSize(buddy) != reach - (long)sizeof(block_header))
+        {
+            return -1;
+        }
+        reach = reach * 2;
+    }
+    while (block < reach)
+    {
+        block_header *buddy = (block_header *)((char *)ptr + block);
+        removeFree(arena, buddy);
+        combine(ptr, buddy);
+        block = block * 2;
+    }
+    getNext(ptr)->size_status &= ~PREV_FREE;
+    return 0;
+}
+
+/* Deferred coalescing */
+/* With MEM_OPT_DEFER_COALESCE a freed block is not merged with its neighbours */
+/* right away. It keeps its busy bit, is marked QUEUED and goes on the quick */
+/* list of its exact size, where the next request of that size takes it back */
+/* in constant time: no search, and no split undoing a merge. Its neighbours */
+/* still see a busy block. An arena coalesces all of its queued blocks at once */
+/* when a search finds nothing or when more than quick_limit pile up, and a */
+/* block whose list is full is merged right away. Queued blocks are counted */
+/* as free in the statistics. */
+
+/* Quick list of a block of 'size' bytes, -1 when such blocks are not queued */
+int quickClass(long size)
+{
+    if (quick_limit == 0 || size > QUICK_MAX_SIZE)
+    {
+        return -1;
+    }
+    return (int)((size + SIZE_BIAS) / MEM_ALIGN);
+}
+
+int isQueued(block_header *ptr)
+{
+    return (ptr->size_status & QUEUED) != 0;
+}
+
+/* Whether 'ptr' has been handed out and not freed since */
+int isBusy(block_header *ptr)
+{
+    return !isFree(ptr) && !isQueued(ptr);
+}
+
+/* Takes the block queued last on quick list i as a busy block */
+/* The caller holds the arena lock and checked that the list is not empty */
+block_header *quickPop(mem_arena *arena, int i)
+{
+    block_header *ptr = arena->quick[i];
+    arena->quick[i] = getLinks(ptr)->list.next_free;
+    arena->quick_counts[i]--;
+    arena->quick_total--;
+    arena->free_bytes = arena->free_bytes - getSize(ptr);
+    arena->free_blocks--;
+    ptr->size_status &= ~QUEUED;
+    return ptr;
+}
+
+/* Coalesces every queued block of 'arena', the caller holds its lock */
+void quickDrain(mem_arena *arena)
+{
+    for (int i = 0; i < QUICK_CLASSES && arena->quick_total > 0; i++)
+    {
+        while (arena->quick[i] != NULL)
+        {
+            freeBlock(arena, quickPop(arena, i));
+        }
+    }
+}
+
+/* Frees the busy block 'ptr', queueing it when deferred coalescing is on */
+/* The caller holds the arena lock */
+void deferFree(mem_arena *arena, block_header *ptr)
+{
+    int i = quickClass(getSize(ptr));
+    if (i < 0 || arena->quick_counts[i] >= QUICK_MAX_COUNT)
+    {
+        freeBlock(arena, ptr);
+        return;
+    }
+    ptr->size_status |= QUEUED;
+    getLinks(ptr)->list.next_free = arena->quick[i];
+    arena->quick[i] = ptr;
+    arena->quick_counts[i]++;
+    arena->quick_total++;
+    arena->free_bytes = arena->free_bytes + getSize(ptr);
+    arena->free_blocks++;
+    if (arena->quick_total > quick_limit)
+    {
+        quickDrain(arena);
+    }
+}
+
+/* Maps more memory at the end of 'arena' so that a block of 'size' bytes fits */
+/* Grows by growth_percent of the current arena size, and at least by what the */
+/* request needs, but never past the arena's share of the maximum footprint. */
+/* The caller holds the arena lock. Returns 0 on success and -1 on failure */
+int growArena(mem_arena *arena, long size)
+{
+    long pagesize = mapGranule();
+    long current = arena->region_end - arena->region_start;
+    long room = arena_stride - current;
+    //Room for the block, a new fence and the class rounding of TLSF
+    long needed = size + (size >> TLSF_SL_LOG)
+        + 2 * sizeof(block_header) + MIN_BLOCK_SIZE;
+    long grow = current * growth_percent / 100;
+
+    //A buddy block of that order fits anywhere in twice its size
+    if (arena->fit == 4) {
+        needed = 2 * (buddySize(size) + (long)sizeof(block_header)) + (long)sizeof(block_header);
+    }
+
+    if (grow < needed) {
+        grow = needed;
+    }
+    grow = (grow + pagesize - 1) / pagesize * pagesize;
+    if (grow > room) {
+        grow = room;
+    }
+    if (grow < needed || mapChunk(arena->region_end, grow) != 0) {
+        return -1;
+    }
+
+    //The old fence becomes the header of the new memory, a new fence closes the arena
+    block_header *old_fence = (block_header *)arena->region_end - 1;
+    arena->region_end = arena->region_end + grow;
+    block_header *fence = (block_header *)arena->region_end - 1;
+    setFence(arena, fence);
+    if (arena->fit == 4) {
+        buddyExtend(arena, (char *)old_fence, (char *)fence, old_fence->size_status & PREV_FREE);
+        return 0;
+    }
+    setNext(old_fence, fence);
+    setSize(old_fence, grow - (long)sizeof(block_header),
+        old_fence->size_status & (PREV_FREE | 0x01));
+    //Freeing it merges it with the last block if that one is free
+    freeBlock(arena, old_fence);
+    return 0;
+}
+
+/* Pointer tables */
+/* Open addressing hash tables keyed by address, with a value per entry for */
+/* the owner's use. They are kept at most half full and mapped straight from */
+/* the kernel, so they never depend on the heap they describe. Removal moves */
+/* the rest of the probe run back into the hole instead of leaving tombstones. */
+typedef struct
+{
+    void *key;
+    unsigned long value;
+} table_entry;
+
+typedef struct
+{
+    table_entry *entries;
+    long capacity;
+    long count;
+} pointer_table;
+
+long tableSlot(pointer_table *table, void *ptr)
+{
+    return (long)((((unsigned long)ptr >> 4) * 0x9e3779b97f4a7c15UL) & (table->capacity - 1));
+}
+
+/* Slot holding 'ptr', or -1 */
+long tableFind(pointer_table *table, void *ptr)
+{
+    if (table->count == 0)
+    {
+        return -1;
+    }
+    long i = tableSlot(table, ptr);
+    while (table->entries[i].key != NULL)
+    {
+        if (table->entries[i].key == ptr)
+        {
+            return i;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return -1;
+}
+
+/* Adds 'ptr' with 'value', doubling the table when it gets half full */
+/* Returns 0 on success and -1 on failure */
+int tableInsert(pointer_table *table, void *ptr, unsigned long value)
+{
+    if (2 * (table->count + 1) > table->capacity)
+    {
+        long capacity = table->capacity == 0 ? 256 : 2 * table->capacity;
+        table_entry *entries = mmap(NULL, capacity * sizeof(table_entry), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == entries)
+        {
+            return -1;
+        }
+        table_entry *old_entries = table->entries;
+        long old_capacity = table->capacity;
+        table->entries = entries;
+        table->capacity = capacity;
+        for (long j = 0; j < old_capacity; j++)
+        {
+            if (old_entries[j].key != NULL)
+            {
+                long i = tableSlot(table, old_entries[j].key);
+                while (table->entries[i].key != NULL)
+                {
+                    i = (i + 1) & (table->capacity - 1);
+                }
+                table->entries[i] = old_entries[j];
+            }
+        }
+        if (old_entries != NULL)
+        {
+            munmap(old_entries, old_capacity * sizeof(table_entry));
+        }
+    }
+    long i = tableSlot(table, ptr);
+    while (table->entries[i].key != NULL)
+    {
+        i = (i + 1) & (table->capacity - 1);
+    }
+    table->entries[i].key = ptr;
+    table->entries[i].value = value;
+    table->count++;
+    return 0;
+}
+
+/* Empties slot i, moving later entries of its probe run back into the hole */
+void tableRemove(pointer_table *table, long i)
+{
+    long hole = i;
+    table->entries[hole].key = NULL;
+    table->count--;
+    i = (hole + 1) & (table->capacity - 1);
+    while (table->entries[i].key != NULL)
+    {
+        long home = tableSlot(table, table->entries[i].key);
+        //Move the entry unless its home lies cyclically in (hole, i]
+        if ((i > hole && (home <= hole || home > i))
+            || (i < hole && home <= hole && home > i))
+        {
+            table->entries[hole] = table->entries[i];
+            table->entries[i].key = NULL;
+            hole = i;
+        }
+        i = (i + 1) & (table->capacity - 1);
+    }
+}
+
+/* Direct mappings */
+/* Requests of mmap_threshold bytes or more get a mapping of their own instead of */
+/* a block of the region, so they neither split the big free blocks of an arena */
+/* nor keep pages resident once freed: Mem_Free unmaps them right away. The */
+/* payload still follows a block header (with MMAPPED set) that records its size. */
+/* Live mappings are kept in a pointer table, so that Mem_Free can tell one */
+/* from a foreign pointer without touching memory that may not exist. */
+pointer_table mmap_table;
+long mmap_bytes = 0;
+pthread_mutex_t mmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bytes between the start of the mapping and a payload aligned to 'align' */
+long mmapOffset(long align)
+{
+    return align > MEM_ALIGN ? align : MEM_ALIGN;
+}
+
+/* Start of the mapping holding the payload 'ptr' */
+char *mmapStart(void *ptr)
+{
+    return (char *)(((unsigned long)ptr - MEM_ALIGN) & ~((unsigned long)getpagesize() - 1));
+}
+
+/* Length of the mapping holding the payload 'ptr' */
+long mmapLength(void *ptr)
+{
+    return getSize((block_header *)ptr - 1) + SIZE_BIAS + ((char *)ptr - mmapStart(ptr));
+}
+
+/* Maps 'size' bytes on their own, the payload aligned to 'align' (at most a page) */
+/* Returns the payload or NULL on failure */
+void *mmapAlloc(long size, long align)
+{
+    long pagesize = getpagesize();
+    long offset = mmapOffset(align);
+    long length = (offset + size + pagesize - 1) / pagesize * pagesize;
+    char *space_ptr = mmap(NULL, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (MAP_FAILED == (void *)space_ptr)
+    {
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages && length >= HUGE_PAGE_SIZE)
+    {
+        madvise(space_ptr, length, MADV_HUGEPAGE);
+    }
+#endif
+
+    //The whole mapping is usable, not just what was asked for
+    block_header *header = (block_header *)(space_ptr + offset) - 1;
+    setNext(header, NULL);
+    setSize(header, length - offset - SIZE_BIAS, MMAPPED | 0x01);
+    setMagic(NULL, header);
+
+    pthread_mutex_lock(&mmap_lock);
+    if (tableInsert(&mmap_table, header + 1, 0) != 0)
+    {
+        pthread_mutex_unlock(&mmap_lock);
+        munmap(space_ptr, length);
+        return NULL;
+    }
+    mmap_bytes = mmap_bytes + length;
+    pthread_mutex_unlock(&mmap_lock);
+    return header + 1;
+}
+
+/* Unmaps the direct mapping whose payload is 'ptr' */
+/* Returns the size of its payload, or -1 when ptr is not a live direct mapping */
+long mmapFree(void *ptr)
+{
+    pthread_mutex_lock(&mmap_lock);
+    long i = tableFind(&mmap_table, ptr);
+    if (i < 0)
+    {
+        pthread_mutex_unlock(&mmap_lock);
+        return -1;
+    }
+    tableRemove(&mmap_table, i);
+    char *start = mmapStart(ptr);
+    long length = mmapLength(ptr);
+    long size = getSize((block_header *)ptr - 1);
+    mmap_bytes = mmap_bytes - length;
+    pthread_mutex_unlock(&mmap_lock);
+    munmap(start, length);
+    return size;
+}
+
+/* Resizes the direct mapping 'ptr' to hold 'size' bytes, the kernel moves */
+/* the pages rather than copying them. Returns the new payload or NULL */
+void *mmapResize(void *ptr, long size)
+{
+    long pagesize = getpagesize();
+    char *start = mmapStart(ptr);
+    long offset = (char *)ptr - start;
+    long new_length = (offset + size + pagesize - 1) / pagesize * pagesize;
+
+    pthread_mutex_lock(&mmap_lock);
+    long i = tableFind(&mmap_table, ptr);
+    if (i < 0)
+    {
+        pthread_mutex_unlock(&mmap_lock);
+        return NULL;
+    }
+    long length = mmapLength(ptr);
+    char *space_ptr = mremap(start, length, new_length, MREMAP_MAYMOVE);
+    if (MAP_FAILED == (void *)space_ptr)
+    {
+        pthread_mutex_unlock(&mmap_lock);
+        return NULL;
+    }
+    tableRemove(&mmap_table, i);
+    block_header *header = (block_header *)(space_ptr + offset) - 1;
+    setSize(header, new_length - offset - SIZE_BIAS, MMAPPED | 0x01);
+    setMagic(NULL, header);
+    //Cannot fail, the table never shrinks and the entry just left it
+    tableInsert(&mmap_table, header + 1, 0);
+    mmap_bytes = mmap_bytes - length + new_length;
+    pthread_mutex_unlock(&mmap_lock);
+    return header + 1;
+}
+
+/* Slabs */
+/* Requests of up to SLAB_MAX_SIZE bytes are served from slabs: SLAB_SIZE aligned */
+/* busy blocks cut into equal slots of one size class. A slab starts with a */
+/* slab_header that tracks its free slots in a bitmap, so objects carry no header */
+/* of their own and allocation and free are a find-first-set and a bit flip. */
+/* Slabs with free slots hang off their arena per class, a slab whose last */
+/* object is freed goes back to the arena as an ordinary free block. A byte map */
+/* per arena records where slabs start, which lets Mem_Free recognise a slab */
+/* object in constant time without trusting anything stored in user memory. */
+/* When the arena cannot carve a slab, small requests fall back to blocks. */
+#define SLAB_MAP_WORDS 4
+#define SLAB_WORD_BITS (8 * (int)sizeof(unsigned long))
+
+typedef struct slab_hd
+{
+    /* Neighbours in the arena's list of slabs with free slots */
+    struct slab_hd *next;
+    struct slab_hd *prev;
+    int cls;
+    int size;
+    int slots;
+    int used;
+    /* Bit set => slot free */
+    unsigned long free_map[SLAB_MAP_WORDS];
+} slab_header;
+
+int slabSetup(mem_arena *arena, long region_size, int fd)
+{
+    void *space_ptr = mmap(NULL, region_size / SLAB_SIZE + 1,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (MAP_FAILED == space_ptr)
+    {
+        return -1;
+    }
+    arena->slab_map = (unsigned char *)space_ptr;
+    return 0;
+}
+
+char *slabSlot(slab_header *slab, int slot)
+{
+    return (char *)(slab + 1) + slot * slab->size;
+}
+
+/* Slab holding 'ptr' or NULL when ptr is not inside a slab of 'arena' */
+slab_header *getSlab(mem_arena *arena, void *ptr)
+{
+    if (arena == NULL)
+    {
+        return NULL;
+    }
+    char *page = (char *)((unsigned long)ptr & ~((unsigned long)SLAB_SIZE - 1));
+    if (page < arena->region_start
+        || !__atomic_load_n(&arena->slab_map[(page - arena->region_start) / SLAB_SIZE], __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return (slab_header *)page;
+}
+
+/* Slot of 'ptr' in 'slab', or -1 unless ptr is the first byte of a busy slot */
+/* Callers may not hold the arena lock, so the bitmap is read, and written */
+/* under the lock, with atomic operations */
+int slabBusySlot(slab_header *slab, void *ptr)
+{
+    long offset = (char *)ptr - slabSlot(slab, 0);
+    if (offset < 0 || offset % slab->size != 0 || offset / slab->size >= slab->slots)
+    {
+        return -1;
+    }
+    int slot = (int)(offset / slab->size);
+    if (__atomic_load_n(&slab->free_map[slot / SLAB_WORD_BITS], __ATOMIC_RELAXED) & (1UL << (slot % SLAB_WORD_BITS)))
+    {
+        return -1;
+    }
+    return slot;
+}
+
+void slabLink(mem_arena *arena, slab_header *slab)
+{
+    slab->prev = NULL;
+    slab->next = arena->slabs[slab->cls];
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab;
+    }
+    arena->slabs[slab->cls] = slab;
+}
+
+void slabUnlink(mem_arena *arena, slab_header *slab)
+{
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        arena->slabs[slab->cls] = slab->next;
+    }
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+}
+
+/* Carves a new slab for class i out of the arena, NULL when nothing fits */
+slab_header *slabCreate(mem_arena *arena, int i)
+{
+    //A buddy block of SLAB_SIZE bytes has room for one header less
+    long room = arena->fit == 4 ? SLAB_SIZE - (long)sizeof(block_header) : requestSize(SLAB_SIZE);
+    block_header *block = allocBlockAligned(arena, room, SLAB_SIZE);
+    if (block == NULL)
+    {
+        return NULL;
+    }
+    slab_header *slab = (slab_header *)(block + 1);
+    slab->cls = i;
+    slab->size = (i + 1) * SLAB_CLASS_SIZE;
+    slab->slots = (int)((room < SLAB_SIZE ? room : SLAB_SIZE) - (long)sizeof(slab_header)) / slab->size;
+    slab->used = 0;
+    memset(slab->free_map, 0, sizeof(slab->free_map));
+    for (int slot = 0; slot < slab->slots; slot++)
+    {
+        slab->free_map[slot / SLAB_WORD_BITS] |= 1UL << (slot % SLAB_WORD_BITS);
+    }
+    arena->slab_free_bytes = arena->slab_free_bytes + (long)slab->slots * slab->size;
+    //Published last, a thread reading the map without the lock sees a whole slab
+    __atomic_store_n(&arena->slab_map[((char *)slab - arena->region_start) / SLAB_SIZE], 1, __ATOMIC_RELEASE);
+    slabLink(arena, slab);
+    return slab;
+}
+
+/* Takes a free slot of class i, creating a slab if needed */
+/* The caller holds the arena lock. Returns NULL when no slab can be carved */
+void *slabAlloc(mem_arena *arena, int i)
+{
+    slab_header *slab = arena->slabs[i];
+    if (slab == NULL)
+    {
+        slab = slabCreate(arena, i);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    int w = 0;
+    while (slab->free_map[w] == 0)
+    {
+        w++;
+    }
+    int slot = w * SLAB_WORD_BITS + __builtin_ctzl(slab->free_map[w]);
+    __atomic_store_n(&slab->free_map[w], slab->free_map[w] & ~(1UL << (slot % SLAB_WORD_BITS)), __ATOMIC_RELAXED);
+    slab->used++;
+    arena->slab_free_bytes = arena->slab_free_bytes - slab->size;
+    //A full slab leaves the list until one of its slots is freed
+    if (slab->used == slab->slots)
+    {
+        slabUnlink(arena, slab);
+    }
+    return slabSlot(slab, slot);
+}
+
+/* Returns the busy slot 'ptr' to 'slab', and the slab to the arena once it is empty */
+/* The caller holds the arena lock */
+void slabFree(mem_arena *arena, slab_header *slab, void *ptr)
+{
+    int slot = (int)(((char *)ptr - slabSlot(slab, 0)) / slab->size);
+    unsigned long *word = &slab->free_map[slot / SLAB_WORD_BITS];
+    __atomic_store_n(word, *word | 1UL << (slot % SLAB_WORD_BITS), __ATOMIC_RELAXED);
+    if (slab->used == slab->slots)
+    {
+        slabLink(arena, slab);
+    }
+    slab->used--;
+    arena->slab_free_bytes = arena->slab_free_bytes + slab->size;
+    if (slab->used == 0)
+    {
+        slabUnlink(arena, slab);
+        arena->slab_free_bytes = arena->slab_free_bytes - (long)slab->slots * slab->size;
+        __atomic_store_n(&arena->slab_map[((char *)slab - arena->region_start) / SLAB_SIZE], 0, __ATOMIC_RELAXED);
+        deferFree(arena, (block_header *)slab - 1);
+    }
+}
+
+/* Gives a small object, slab slot or block, back to 'arena' */
+/* The caller holds the arena lock */
+void smallFree(mem_arena *arena, void *ptr)
+{
+    slab_header *slab = getSlab(arena, ptr);
+    if (slab != NULL)
+    {
+        slabFree(arena, slab, ptr);
+    }
+    else
+    {
+        deferFree(arena, (block_header *)ptr - 1);
+    }
+}
+
+/* Per-thread caches */
+/* Every thread keeps a few recently freed small blocks per size class in thread */
+/* local storage. A Mem_Alloc/Mem_Free pair on a warm class never touches the */
+/* shared state or an arena lock. A class that runs dry is refilled with a batch of */
+/* blocks under a single lock hold, and a class that overflows TCACHE_MAX_COUNT */
+/* hands TCACHE_BATCH blocks back the same way. The refill batch starts at one */
+/* block and doubles on every refill up to TCACHE_BATCH, so classes that are used */
+/* once do not hoard memory in small regions. Cached blocks stay busy as far as */
+/* the block list is concerned (Mem_Dump shows them as Busy), and a thread gives */
+/* its whole cache back when it exits. */
+#define TCACHE_CLASS_SIZE SLAB_CLASS_SIZE
+#define TCACHE_CLASSES SLAB_CLASSES
+#define TCACHE_MAX_SIZE (TCACHE_CLASSES * TCACHE_CLASS_SIZE)
+#define TCACHE_MAX_COUNT 32
+#define TCACHE_BATCH 16
+
+/* A cached block keeps these in its payload */
+typedef struct tcache_hd
+{
+    struct tcache_hd *next;
+    /* TCACHE_KEY while the block is in a cache, to catch double frees */
+    void *key;
+} tcache_entry;
+
+typedef struct thread_cache_hd
+{
+    tcache_entry *bins[TCACHE_CLASSES];
+    int counts[TCACHE_CLASSES];
+    /* How many blocks the next refill of the class takes, 0 means 1 */
+    int fill[TCACHE_CLASSES];
+    int registered;
+    /* Statistics of the thread, see Mem_GetStats. A free is counted by the */
+    /* thread that frees, so only the sum over all threads is meaningful. */
+    /* Bytes are counted as objects leave and return to the arenas, so the */
+    /* hits and misses of the cache itself only bump allocs and frees. */
+    /* cached_bytes is the part of in_use_bytes waiting in the bins, counted */
+    /* at the size of their class */
+    long allocs;
+    long frees;
+    long failures;
+    long in_use_bytes;
+    long cached_bytes;
+    /* Next cache in the list of live threads */
+    struct thread_cache_hd *next_cache;
+} thread_cache;
+
+__thread thread_cache tcache;
+/* The address of tcache_mark is what a cached block holds in its key */
+char tcache_mark;
+#define TCACHE_KEY ((void *)&tcache_mark)
+pthread_key_t tcache_exit_key;
+pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+/* Caches of the live threads, so their counters can be added up, and the */
+/* counters left behind by threads that exited */
+thread_cache *live_caches = NULL;
+thread_cache retired_cache;
+pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Class a request of 'size' bytes is served from, or -1 if it is not cached */
+/* Class i holds blocks of at least (i + 1) * TCACHE_CLASS_SIZE bytes */
+int tcacheClass(size_t size)
+{
+    if (size > TCACHE_MAX_SIZE)
+    {
+        return -1;
+    }
+    return (int)((size + TCACHE_CLASS_SIZE - 1) / TCACHE_CLASS_SIZE) - 1;
+}
+
+/* Class a freed block of 'size' bytes can serve, or -1 if it is not cached */
+int tcacheBlockClass(long size)
+{
+    long i = size / TCACHE_CLASS_SIZE - 1;
+    if (i < 0 || i >= TCACHE_CLASSES)
+    {
+        return -1;
+    }
+    return (int)i;
+}
+
+void tcachePush(thread_cache *cache, int i, void *ptr)
+{
+    tcache_entry *entry = (tcache_entry *)ptr;
+    entry->next = cache->bins[i];
+    __atomic_store_n(&entry->key, TCACHE_KEY, __ATOMIC_RELAXED);
+    cache->bins[i] = entry;
+    cache->counts[i]++;
+    cache->cached_bytes = cache->cached_bytes + (i + 1) * TCACHE_CLASS_SIZE;
+}
+
+void *tcachePop(thread_cache *cache, int i)
+{
+    tcache_entry *entry = cache->bins[i];
+    cache->bins[i] = entry->next;
+    cache->counts[i]--;
+    cache->cached_bytes = cache->cached_bytes - (i + 1) * TCACHE_CLASS_SIZE;
+    __atomic_store_n(&entry->key, NULL, __ATOMIC_RELEASE);
+    return entry;
+}
+
+/* Whether the object 'ptr' of 'size' usable bytes waits in a thread cache, */
+/* where its slot or block still looks busy */
+int tcacheHolds(void *ptr, long size)
+{
+    return tcacheBlockClass(size) >= 0
+        && __atomic_load_n(&((tcache_entry *)ptr)->key, __ATOMIC_ACQUIRE) == TCACHE_KEY;
+}
+
+/* Gives up to 'count' blocks of class i back to their arenas */
+/* Runs of blocks from the same arena are freed under one lock hold */
+void tcacheFlush(thread_cache *cache, int i, int count)
+{
+    mem_arena *locked = NULL;
+
+    //Overflowing means the refills were too generous
+    cache->fill[i] = cache->fill[i] / 2;
+    while (count > 0 && cache->counts[i] > 0)
+    {
+        void *ptr = tcachePop(cache, i);
+        mem_arena *arena = getArena(ptr);
+        if (arena != locked)
+        {
+            if (locked != NULL)
+            {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+        cache->in_use_bytes = cache->in_use_bytes - objectSize(ptr);
+        smallFree(arena, ptr);
+        count--;
+    }
+    if (locked != NULL)
+    {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+/* Thread exit: return every cached block */
+void tcacheRelease(void *arg)
+{
+    thread_cache *cache = (thread_cache *)arg;
+    for (int i = 0; i < TCACHE_CLASSES; i++)
+    {
+        tcacheFlush(cache, i, cache->counts[i]);
+    }
+
+    //Its counters outlive the thread
+    if (cache->registered)
+    {
+        pthread_mutex_lock(&caches_lock);
+        thread_cache **link = &live_caches;
+        while (*link != cache)
+        {
+            link = &(*link)->next_cache;
+        }
+        *link = cache->next_cache;
+        retired_cache.allocs = retired_cache.allocs + cache->allocs;
+        retired_cache.frees = retired_cache.frees + cache->frees;
+        retired_cache.failures = retired_cache.failures + cache->failures;
+        retired_cache.in_use_bytes = retired_cache.in_use_bytes + cache->in_use_bytes;
+        cache->allocs = 0;
+        cache->frees = 0;
+        cache->failures = 0;
+        cache->in_use_bytes = 0;
+        pthread_mutex_unlock(&caches_lock);
+        cache->registered = 0;
+    }
+}
+
+void tcacheCreateKey()
+{
+    pthread_key_create(&tcache_exit_key, tcacheRelease);
+}
+
+/* Hooks the calling thread's cache up for thread exit and for Mem_GetStats */
+void tcacheRegister(thread_cache *cache)
+{
+    //Set first: pthread_setspecific may allocate, and when Mem_Alloc stands in
+    //for malloc that must not register the cache all over again
+    cache->registered = 1;
+    pthread_once(&tcache_once, tcacheCreateKey);
+    pthread_setspecific(tcache_exit_key, cache);
+    pthread_mutex_lock(&caches_lock);
+    cache->next_cache = live_caches;
+    live_caches = cache;
+    pthread_mutex_unlock(&caches_lock);
+}
+
+void *allocAnyArena(mem_arena *arena, long size, long align, int zero);
+
+/* Takes a batch of objects of class i from the thread's arena under one lock hold */
+/* Slab slots are preferred, blocks are used when no slab can be carved */
+/* Returns one of them for the caller and caches the rest */
+void *tcacheRefill(thread_cache *cache, int i)
+{
+    mem_arena *arena = threadArena();
+    long size = requestSize((i + 1) * TCACHE_CLASS_SIZE);
+    int batch = cache->fill[i] > 0 ? cache->fill[i] : 1;
+    void *found = NULL;
+
+    if (!cache->registered)
+    {
+        tcacheRegister(cache);
+    }
+
+    if (batch < TCACHE_BATCH)
+    {
+        cache->fill[i] = batch * 2;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+    for (int n = 0; n < batch; n++)
+    {
+        void *object = slabAlloc(arena, i);
+        long object_size = (i + 1) * SLAB_CLASS_SIZE;
+        if (object == NULL)
+        {
+            block_header *block = allocBlock(arena, size);
+            if (block == NULL)
+            {
+                break;
+            }
+            object = block + 1;
+            object_size = getSize(block);
+        }
+        cache->in_use_bytes = cache->in_use_bytes + object_size;
+        if (found == NULL)
+        {
+            found = object;
+        }
+        else
+        {
+            tcachePush(cache, i, object);
+        }
+    }
+    pthread_mutex_unlock(&arena->lock);
+
+    if (found == NULL)
+    {
+        //Our arena is full, borrow a single block from another one
+        found = allocAnyArena(arena, size, 0, 0);
+        if (found != NULL)
+        {
+            cache->in_use_bytes = cache->in_use_bytes + getSize((block_header *)found - 1);
+        }
+    }
+    return found;
+}
+
+/* Statistics */
+/* Every thread counts its own allocations and frees in its cache, with no lock */
+/* and no shared cache line to fight over, and every arena counts its free */
+/* blocks and the steps of its searches under the lock it holds anyway. */
+/* Mem_GetStats only adds these up. */
+
+/* Usable size of the busy object 'ptr': its slot, block or mapping */
+long objectSize(void *ptr)
+{
+    slab_header *slab = getSlab(getArena(ptr), ptr);
+    if (slab != NULL)
+    {
+        return slab->size;
+    }
+    return getSize((block_header *)ptr - 1);
+}
+
+/* Counts the object 'ptr' just handed out by the thread cache, whose bytes */
+/* were counted when the cache took it, or a failure when it is NULL */
+/* Returns ptr */
+void *countCachedAlloc(void *ptr)
+{
+    if (!tcache.registered)
+    {
+        tcacheRegister(&tcache);
+    }
+    if (ptr == NULL)
+    {
+        tcache.failures++;
+        return NULL;
+    }
+    tcache.allocs++;
+    return ptr;
+}
+
+/* Counts the object 'ptr' just handed out, or a failure when it is NULL */
+/* Returns ptr */
+void *countAlloc(void *ptr)
+{
+    if (countCachedAlloc(ptr) != NULL)
+    {
+        tcache.in_use_bytes = tcache.in_use_bytes + objectSize(ptr);
+    }
+    return ptr;
+}
+
+/* Counts the free of an object of 'size' usable bytes, 0 when it goes to */
+/* the thread cache */
+void countFree(long size)
+{
+    if (!tcache.registered)
+    {
+        tcacheRegister(&tcache);
+    }
+    tcache.frees++;
+    tcache.in_use_bytes = tcache.in_use_bytes - size;
+}
+
+/* Counts the object 'ptr' resized in place from 'old_size' usable bytes, or a */
+/* failure when it is NULL. Returns ptr */
+void *countResize(long old_size, void *ptr)
+{
+    if (!tcache.registered)
+    {
+        tcacheRegister(&tcache);
+    }
+    if (ptr == NULL)
+    {
+        tcache.failures++;
+        return NULL;
+    }
+    tcache.in_use_bytes = tcache.in_use_bytes + objectSize(ptr) - old_size;
+    return ptr;
+}
+
+/* Size of the largest free block of 'arena', the caller holds its lock */
+long largestFree(mem_arena *arena)
+{
+    long largest = 0;
+    if (arena->fit == 0)
+    {
+        //The rightmost node of the treap
+        block_header *node = arena->tree_root;
+        while (node != NULL && treeRight(node) != NULL)
+        {
+            node = treeRight(node);
+        }
+        if (node != NULL)
+        {
+            largest = getSize(node);
+        }
+    }
+    else if (arena->fit == 2)
+    {
+        if (arena->heap_count > 0)
+        {
+            largest = getSize(arena->heap_array[0]);
+        }
+    }
+    else if (arena->fit == 4)
+    {
+        //Any block of the highest non-empty order
+        if (arena->buddy_bitmap != 0)
+        {
+            largest = (1L << tlsfFls(arena->buddy_bitmap)) - (long)sizeof(block_header);
+        }
+    }
+    else if (arena->fit == 3)
+    {
+        //Somewhere in the highest non-empty class
+        if (arena->tlsf_fl_bitmap != 0)
+        {
+            int fl = tlsfFls(arena->tlsf_fl_bitmap);
+            int sl = tlsfFls(arena->tlsf_sl_bitmap[fl]);
+            for (block_header *node = arena->tlsf_free[fl][sl]; node != NULL;
+                node = getLinks(node)->list.next_free)
+            {
+                if (getSize(node) > largest)
+                {
+                    largest = getSize(node);
+                }
+            }
+        }
+    }
+    else
+    {
+        //First fit keeps no index, its free blocks are on the block list
+        for (block_header *node = arena->list_head; node != NULL; node = getNext(node))
+        {
+            if (isFree(node) && getSize(node) > largest)
+            {
+                largest = getSize(node);
+            }
+        }
+    }
+    return largest;
+}
+
+/* Clears the payload of the fresh block 'ptr' for Mem_Calloc */
+/* 'clean' is the clean mark of its arena from before the block was handed out */
+/* Only what lies below the mark, and the bookkeeping above it, is written */
+void clearBlock(block_header *ptr, char *clean)
+{
+    char *begin = (char *)(ptr + 1);
+    char *end = begin + getSize(ptr);
+    char *dirty = clean < end ? clean : end;
+
+    //The links of the free block it came from may sit above the mark
+    if (dirty < begin + sizeof(free_links)) {
+        dirty = begin + sizeof(free_links);
+    }
+    memset(begin, 0, dirty - begin);
+    //And so may its footer
+    *getFooter(ptr) = NULL;
+}
+
+/* Allocates from 'arena' and, when it has nothing that fits, from the other arenas */
+/* so that memory sitting in a quiet arena is not lost to busy threads */
+/* Only when no arena has room does 'arena' map more memory */
+/* 'align' above MEM_ALIGN asks for a payload aligned to it, see allocBlockAligned() */
+/* With 'zero' set the block is cleared, see clearBlock() */
+void *allocAnyArena(mem_arena *arena, long size, long align, int zero)
+{
+    int first = arena - arenas;
+    block_header *found = NULL;
+    char *clean;
+    for (int n = 0; n < arena_count; n++)
+    {
+        arena = &arenas[(first + n) % arena_count];
+        pthread_mutex_lock(&arena->lock);
+        clean = arena->clean;
+        found = carveBlock(arena, size, align);
+        pthread_mutex_unlock(&arena->lock);
+        if (found != NULL)
+        {
+            break;
+        }
+    }
+
+    if (found == NULL)
+    {
+        arena = &arenas[first];
+        pthread_mutex_lock(&arena->lock);
+        clean = arena->clean;
+        if (growArena(arena, align > MEM_ALIGN ? alignedRequest(size, align) : size) == 0)
+        {
+            found = carveBlock(arena, size, align);
+        }
+        pthread_mutex_unlock(&arena->lock);
+        if (found == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    if (zero)
+    {
+        clearBlock(found, clean);
+    }
+    return found + 1;
+}
+
+/* Batches */
+/* Mem_AllocBatch asks the policy for one free block big enough for the whole */
+/* batch and cuts it into equal busy blocks in a single pass, so the search and */
+/* the free index update happen once per batch instead of once per block. */
+/* Mem_FreeBatch sorts the blocks it is given by address: each arena is locked */
+/* once, and blocks that follow each other are merged into one before that one */
+/* is freed, so the neighbours and the free index are touched once per run. */
+/* Small objects and direct mappings take their usual road, the thread cache */
+/* and munmap are as cheap as it gets already. */
+#define BATCH_MAX 256
+
+/* Cuts the busy block 'ptr' into 'count' busy blocks of 'size' bytes laid end */
+/* to end, the last one keeps what is left over. Their payloads go to 'out' */
+void splitBatch(mem_arena *arena, block_header *ptr, long size, long count, void **out)
+{
+    for (long n = 0; n < count - 1; n++)
+    {
+        block_header *piece = (block_header *)((char *)(ptr + 1) + size);
+        setNext(piece, getNext(ptr));
+        setSize(piece, getSize(ptr) - size - (long)sizeof(block_header), 0x01);
+        setMagic(arena, piece);
+        setNext(ptr, piece);
+        setSize(ptr, size, ptr->size_status & (PREV_FREE | 0x01));
+        out[n] = ptr + 1;
+        ptr = piece;
+    }
+    out[count - 1] = ptr + 1;
+}
+
+/* Carves up to 'count' blocks of 'size' bytes from 'arena', out of as few free */
+/* blocks as it can: room for the whole batch is asked for first, then halves */
+/* The caller holds the arena lock. Returns how many blocks were carved */
+long allocBatch(mem_arena *arena, long size, long count, void **out)
+{
+    long done = 0;
+    long run = count;
+    long most = (MEM_MAX_REGION + (long)sizeof(block_header)) / (size + (long)sizeof(block_header));
+
+    if (run > most)
+    {
+        run = most;
+    }
+    //Buddy blocks cannot be cut into pieces of any size, so they come one by one
+    if (arena->fit == 4)
+    {
+        while (done < count)
+        {
+            block_header *block = allocBlock(arena, size);
+            if (block == NULL)
+            {
+                break;
+            }
+            out[done] = block + 1;
+            done++;
+        }
+        return done;
+    }
+    while (done < count && run > 0)
+    {
+        if (run > count - done)
+        {
+            run = count - done;
+        }
+        block_header *block = allocBlock(arena, run * (size + (long)sizeof(block_header))
+            - (long)sizeof(block_header));
+        if (block == NULL)
+        {
+            run = run / 2;
+            continue;
+        }
+        splitBatch(arena, block, size, run, out + done);
+        done = done + run;
+    }
+    return done;
+}
+
+int comparePointers(const void *a, const void *b)
+{
+    unsigned long x = (unsigned long)*(void *const *)a;
+    unsigned long y = (unsigned long)*(void *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Whether Mem_FreeBatch hands 'ptr' to freeSorted: a block of an arena that */
+/* is neither a slab nor small enough for the thread cache. Checked again under */
+/* the lock */
+int isBatchBlock(void *ptr)
+{
+    mem_arena *arena = getArena(ptr);
+    if (arena == NULL || getSlab(arena, ptr) != NULL)
+    {
+        return 0;
+    }
+    block_header *header = getHeader(arena, ptr);
+    return header != NULL && tcacheBlockClass(getSize(header)) < 0;
+}
+
+/* Frees the blocks 'ptrs', sorted by address, with one lock hold per arena */
+/* A block that directly follows the previous one is merged into it, the run */
+/* is freed as a whole once it ends */
+/* Returns -1 if one of them is not a busy block or appears twice, the others */
+/* are freed anyway, and 0 otherwise */
+int freeSorted(void **ptrs, long count)
+{
+    int result = 0;
+    mem_arena *locked = NULL;
+    block_header *run = NULL;
+
+    for (long k = 0; k < count; k++)
+    {
+        mem_arena *arena = getArena(ptrs[k]);
+        if (arena != locked)
+        {
+            if (run != NULL)
+            {
+                deferFree(locked, run);
+                run = NULL;
+            }
+            if (locked != NULL)
+            {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&arena->lock);
+            locked = arena;
+        }
+        block_header *ptr = getHeader(arena, ptrs[k]);
+        if (ptr == NULL || !isBusy(ptr) || (k > 0 && ptrs[k] == ptrs[k - 1]))
+        {
+            result = -1;
+            continue;
+        }
+        countFree(getSize(ptr));
+        //Buddy blocks only merge with their buddies
+        if (arena->fit != 4 && run != NULL && getNext(run) == ptr)
+        {
+            combine(run, ptr);
+            continue;
+        }
+        if (run != NULL)
+        {
+            deferFree(arena, run);
+        }
+        run = ptr;
+    }
+    if (run != NULL)
+    {
+        deferFree(locked, run);
+    }
+    if (locked != NULL)
+    {
+        pthread_mutex_unlock(&locked->lock);
+    }
+    return result;
+}
+
+/* Traces */
+/* Mem_Trace records the allocations and frees made through the API to a file */
+/* that replay.c plays back against each policy. Objects are named by logical */
+/* ids handed out in allocation order, so a trace does not depend on the */
+/* addresses of the run that recorded it; a pointer table maps live traced */
+/* objects to their ids. Events (see mem_trace_event in mem.h) are buffered and */
+/* written TRACE_BUFFER at a time with write(2), the heap is never used for it. */
+/* While nothing is recorded each hook costs a single test. */
+#define TRACE_BUFFER 4096
+
+int trace_fd = -1;
+int trace_exit_registered = 0;
+pointer_table trace_ids;
+unsigned int trace_next_id = 1;
+mem_trace_event trace_buffer[TRACE_BUFFER];
+int trace_count = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Writes out the buffered events, the caller holds trace_lock */
+void traceFlush()
+{
+    char *data = (char *)trace_buffer;
+    long left = trace_count * (long)sizeof(mem_trace_event);
+    while (left > 0)
+    {
+        long written = write(trace_fd, data, left);
+        if (written <= 0)
+        {
+            break;
+        }
+        data = data + written;
+        left = left - written;
+    }
+    trace_count = 0;
+}
+
+/* Appends an event, the caller holds trace_lock */
+void traceWrite(unsigned int op, unsigned int id, unsigned long size)
+{
+    if (trace_count == TRACE_BUFFER)
+    {
+        traceFlush();
+    }
+    trace_buffer[trace_count].op = op;
+    trace_buffer[trace_count].id = id;
+    trace_buffer[trace_count].size = size;
+    trace_count++;
+}
+
+/* Records an allocation of 'size' bytes aligned to 'alignment' (0 for the */
+/* MEM_ALIGN every payload gets) that returned 'ptr', failures are not */
+/* recorded. Returns ptr */
+void *traceAllocAligned(void *ptr, size_t size, size_t alignment)
+{
+    if (trace_fd < 0 || ptr == NULL)
+    {
+        return ptr;
+    }
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0 && tableInsert(&trace_ids, ptr, trace_next_id) == 0)
+    {
+        traceWrite(alignment == 0 ? MEM_TRACE_ALLOC
+            : MEM_TRACE_ALLOC_ALIGNED | (unsigned int)__builtin_ctzl(alignment) << MEM_TRACE_OP_BITS,
+            trace_next_id, size);
+        trace_next_id++;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return ptr;
+}
+
+void *traceAlloc(void *ptr, size_t size)
+{
+    return traceAllocAligned(ptr, size, 0);
+}
+
+/* Records the free of 'ptr' if it is a traced object. Called before the object */
+/* is freed, so that its address cannot be handed out and traced again first */
+void traceFree(void *ptr)
+{
+    if (trace_fd < 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    long i = trace_fd >= 0 ? tableFind(&trace_ids, ptr) : -1;
+    if (i >= 0)
+    {
+        traceWrite(MEM_TRACE_FREE, (unsigned int)trace_ids.entries[i].value, 0);
+        tableRemove(&trace_ids, i);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* Records that 'ptr' was resized to 'size' bytes and now lives at 'moved' */
+/* An object from before the trace started shows up as a new allocation */
+/* Returns moved */
+void *traceResize(void *ptr, void *moved, size_t size)
+{
+    if (trace_fd < 0 || moved == NULL)
+    {
+        return moved;
+    }
+    pthread_mutex_lock(&trace_lock);
+    long i = trace_fd >= 0 ? tableFind(&trace_ids, ptr) : -1;
+    if (i >= 0)
+    {
+        unsigned int id = (unsigned int)trace_ids.entries[i].value;
+        tableRemove(&trace_ids, i);
+        tableInsert(&trace_ids, moved, id);
+        traceWrite(MEM_TRACE_REALLOC, id, size);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (i < 0)
+    {
+        traceAlloc(moved, size);
+    }
+    return moved;
+}
+
+/* Stops the trace at exit, so that the buffered events are not lost */
+void traceExit()
+{
+    Mem_Trace(NULL);
+}
+
+/* Fork */
+/* A fork while another thread holds one of the locks would leave the lock */
+/* taken for good in the child. Mem_Init registers these with pthread_atfork: */
+/* the forking thread takes every lock, in the order the rest of the code */
+/* nests them, and parent and child let go once the copy is made. Blocks in */
+/* the caches of the threads that do not exist in the child stay busy there. */
+/* Heaps of Mem_HeapCreate and Mem_HeapOpen need no Mem_Init, so the first of */
+/* them registers the handlers too, and they are kept on a list for them. */
+mem_arena *live_heaps = NULL;
+pthread_mutex_t heaps_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+
+void forkPrepare()
+{
+    pthread_mutex_lock(&trace_lock);
+    for (int a = 0; a < arena_count; a++)
+    {
+        pthread_mutex_lock(&arenas[a].lock);
+    }
+    pthread_mutex_lock(&heaps_lock);
+    for (mem_arena *heap = live_heaps; heap != NULL; heap = heap->next_heap)
+    {
+        pthread_mutex_lock(&heap->lock);
+    }
+    pthread_mutex_lock(&caches_lock);
+    pthread_mutex_lock(&mmap_lock);
+}
+
+/* The lock of a heap opened from a file is in the shared mapping, the child */
+/* sees it unlocked once the parent lets go and must not let go a second time */
+void forkUnlock(int child)
+{
+    pthread_mutex_unlock(&mmap_lock);
+    pthread_mutex_unlock(&caches_lock);
+    for (mem_arena *heap = live_heaps; heap != NULL; heap = heap->next_heap)
+    {
+        if (!child || heap->file == NULL)
+        {
+            pthread_mutex_unlock(&heap->lock);
+        }
+    }
+    pthread_mutex_unlock(&heaps_lock);
+    for (int a = arena_count - 1; a >= 0; a--)
+    {
+        pthread_mutex_unlock(&arenas[a].lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void forkRelease()
+{
+    forkUnlock(0);
+}
+
+void forkChild()
+{
+    forkUnlock(1);
+}
+
+void forkHandlers()
+{
+    pthread_atfork(forkPrepare, forkRelease, forkChild);
+}
+
+/* Registers the handlers, once for the process */
+void forkRegister()
+{
+    pthread_once(&fork_once, forkHandlers);
+}
+
+/* Puts the new heap 'heap' on the list of live heaps */
+void heapLink(mem_arena *heap)
+{
+    forkRegister();
+    pthread_mutex_lock(&heaps_lock);
+    heap->prev_heap = NULL;
+    heap->next_heap = live_heaps;
+    if (live_heaps != NULL)
+    {
+        live_heaps->prev_heap = heap;
+    }
+    live_heaps = heap;
+    pthread_mutex_unlock(&heaps_lock);
+}
+
+/* Takes 'heap' off the list of live heaps before it goes away */
+void heapUnlink(mem_arena *heap)
+{
+    pthread_mutex_lock(&heaps_lock);
+    if (heap->prev_heap != NULL)
+    {
+        heap->prev_heap->next_heap = heap->next_heap;
+    }
+    else
+    {
+        live_heaps = heap->next_heap;
+    }
+    if (heap->next_heap != NULL)
+    {
+        heap->next_heap->prev_heap = heap->prev_heap;
+    }
+    pthread_mutex_unlock(&heaps_lock);
+}
+
+/* Size a request of 'size' bytes is served with, or -1 if it cannot be served */
+long requestSize(size_t size)
+{
+    /** Checking for Sanity
+     * 1. Cannot allocate memory if size requested is zero
+     * 2. Cannot alloctae memory if no memory is left
+    */
+    if (size == 0 || size > MEM_MAX_REGION)
+    {
+        return -1;
+    }
+
+
+    //Round up size so that the block fills whole MEM_ALIGN granules
+    long block_size = (long)size;
+    if ((block_size + SIZE_BIAS) % MEM_ALIGN != 0)
+    {
+        block_size = ((block_size + SIZE_BIAS) | (MEM_ALIGN - 1)) + 1 - SIZE_BIAS;
+    }
+    //Room for the free bookkeeping once the block comes back
+    if (block_size < MIN_BLOCK_SIZE)
+    {
+        block_size = MIN_BLOCK_SIZE;
+    }
+    return block_size;
+}
+
+/* Does the work of Mem_Alloc, see below. The API calls it rather than */
+/* Mem_Alloc so that a nested call does not show up in a trace */
+void *allocObject(size_t size)
+{
+    long block_size = requestSize(size);
+    if (block_size < 0)
+    {
+        return NULL;
+    }
+
+    //Small sizes - the thread cache, no lock on a hit
+    //Slab slots carry no header, so the class follows the size asked for
+    int i = tcacheClass(size);
+    if (i >= 0)
+    {
+        if (tcache.counts[i] > 0)
+        {
+            return countCachedAlloc(tcachePop(&tcache, i));
+        }
+        return countCachedAlloc(tcacheRefill(&tcache, i));
+    }
+
+    //Large sizes - a mapping of their own
+    if (mmap_threshold > 0 && block_size >= mmap_threshold)
+    {
+        return countAlloc(mmapAlloc(block_size, 0));
+    }
+
+    return countAlloc(allocAnyArena(threadArena(), block_size, 0, 0));
+}
+
+/* Function for allocating 'size' bytes. */
+/* Returns address of allocated block on success */
+/* Returns NULL on failure */
+/* Here is what this function should accomplish */
+/* - Check for sanity of size - Return NULL when appropriate */
+/* - Round up size to a multiple of MEM_ALIGN (16), so that payloads are 16-byte aligned */
+/* - Serve small sizes from the calling thread's cache, backed by slabs */
+/* - Map sizes of mmap_threshold bytes or more on their own */
+/* - Otherwise let the policy find, in the calling thread's arena first, a free block which can accommodate the requested size */
+/* -- Also, when allocating a block - split it into two blocks when possible */
+/* - Record the call when a trace is being recorded, see Mem_Trace */
+/* Safe to call from several threads at once */
+void *Mem_Alloc(size_t size)
+{
+    return traceAlloc(allocObject(size), size);
+}
+
+/* Does the work of Mem_Free, see below */
+int freeObject(void *ptr)
+{
+    //Null ptr return -1
+    if (ptr == NULL) {
+        return -1;
+    }
+    mem_arena *arena = getArena(ptr);
+    //Outside the region it can only be a direct mapping
+    if (arena == NULL) {
+        long size = mmapFree(ptr);
+        if (size < 0) {
+            return -1;
+        }
+        countFree(size);
+        return 0;
+    }
+    block_header *req_pointer = NULL;
+    int i;
+    slab_header *slab = getSlab(arena, ptr);
+    if (slab != NULL) {
+        //Not the start of a busy slot return -1
+        if (slabBusySlot(slab, ptr) < 0) {
+            return -1;
+        }
+        i = slab->cls;
+    }
+    else {
+        //Not the start of a block return -1
+        req_pointer = getHeader(arena, ptr);
+        if (req_pointer == NULL) {
+            return -1;
+        }
+
+        //if already pointing to free or queued block return -1
+        block_header seen = loadHeader(req_pointer);
+        if (!isBusy(&seen)) {
+            return -1;
+        }
+        i = tcacheBlockClass(getSize(&seen));
+    }
+
+    if (i >= 0) {
+        //Already sitting in a thread cache return -1. Only one of two threads
+        //freeing the same object at once gets to mark it
+        if (__atomic_exchange_n(&((tcache_entry *)ptr)->key, TCACHE_KEY, __ATOMIC_ACQ_REL) == TCACHE_KEY) {
+            return -1;
+        }
+        countFree(0);
+        if (tcache.counts[i] >= TCACHE_MAX_COUNT) {
+            tcacheFlush(&tcache, i, TCACHE_BATCH);
+        }
+        tcachePush(&tcache, i, ptr);
+        return 0;
+    }
+
+    //The block goes back to the arena it came from, whichever thread frees it
+    pthread_mutex_lock(&arena->lock);
+    //Recheck under the lock, another thread may have freed it meanwhile
+    if (!isBusy(req_pointer)) {
+        pthread_mutex_unlock(&arena->lock);
+        return -1;
+    }
+    countFree(getSize(req_pointer));
+    deferFree(arena, req_pointer);
+    pthread_mutex_unlock(&arena->lock);
+    return 0;
+}
+
+/* Function for freeing up a previously allocated block */
+/* Argument - ptr: Address of the block to be freed up */
+/* Returns 0 on success */
+/* Returns -1 on failure */
+/* Here is what this function should accomplish */
+/* - Return -1 if ptr is NULL */
+/* - Return -1 if ptr is not pointing to the first byte of a busy block or slab slot */
+/*   (checked in constant time against the arena bounds and the header cookie, */
+/*   or the slab map and the slot bitmap) */
+/* - Direct mappings are unmapped */
+/* - Small blocks go to the calling thread's cache */
+/* - Otherwise mark the block as free */
+/* - Coalesce if one or both of the immediate neighbours are free */
+/*   (with MEM_OPT_DEFER_COALESCE the block is queued by size instead, and */
+/*   coalesced later along with the others, see deferFree) */
+/* - Record the call when a trace is being recorded, see Mem_Trace */
+/* Safe to call from several threads at once */
+int Mem_Free(void *ptr)
+{
+    traceFree(ptr);
+    return freeObject(ptr);
+}
+
+/* Function for allocating 'size' bytes aligned to 'alignment' bytes */
+/* 'alignment' must be a power of two, eg 64 for a cache line or 4096 for a page */
+/* Returns address of allocated block on success */
+/* Returns NULL on failure */
+/* The padding in front of the aligned payload goes back to the free list */
+/* The block is freed with Mem_Free like any other */
+/* Safe to call from several threads at once */
+void *Mem_AllocAligned(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > MEM_MAX_REGION)
+    {
+        return NULL;
+    }
+    //Every payload is aligned this much anyway
+    if (alignment <= MEM_ALIGN)
+    {
+        return traceAlloc(allocObject(size), size);
+    }
+    long block_size = requestSize(size);
+    if (block_size < 0)
+    {
+        return NULL;
+    }
+    if (mmap_threshold > 0 && block_size >= mmap_threshold && (long)alignment <= getpagesize())
+    {
+        return traceAllocAligned(countAlloc(mmapAlloc(block_size, (long)alignment)), size, alignment);
+    }
+    return traceAllocAligned(countAlloc(allocAnyArena(threadArena(), block_size, (long)alignment, 0)),
+        size, alignment);
+}
+
+/* Function for allocating a zeroed array of 'count' elements of 'size' bytes */
+/* Returns address of allocated block on success */
+/* Returns NULL on failure */
+/* Memory that was never handed out is still zero from /dev/zero, so large */
+/* blocks only clear the part that has been used before (see clearBlock) */
+/* Safe to call from several threads at once */
+void *Mem_Calloc(size_t count, size_t size)
+{
+    if (count == 0 || size == 0 || count > MEM_MAX_REGION / size)
+    {
+        return NULL;
+    }
+    size_t total = count * size;
+    long block_size = requestSize(total);
+    if (block_size < 0)
+    {
+        return NULL;
+    }
+
+    //Small sizes come from recycled slots, just clear them
+    if (tcacheClass(total) >= 0)
+    {
+        void *ptr = allocObject(total);
+        if (ptr != NULL)
+        {
+            memset(ptr, 0, total);
+        }
+        return traceAlloc(ptr, total);
+    }
+
+    //Fresh mappings are zero already
+    if (mmap_threshold > 0 && block_size >= mmap_threshold)
+    {
+        return traceAlloc(countAlloc(mmapAlloc(block_size, 0)), total);
+    }
+
+    return traceAlloc(countAlloc(allocAnyArena(threadArena(), block_size, 0, 1)), total);
+}
+
+/* Function for resizing a previously allocated block to 'size' bytes */
+/* Argument - ptr: Address of the block, NULL behaves like Mem_Alloc */
+/* Returns the address of the resized block, which may have moved */
+/* Returns NULL on failure, the old block is then left untouched */
+/* Here is what this function should accomplish */
+/* - Return NULL if size is not sane or ptr is not a busy block or slab slot, */
+/*   or waits in a thread cache */
+/* - A slab slot that is still big enough is kept as is */
+/* - Shrink a block in place, giving the tail back when it can stand on its own */
+/* - Grow a block in place by absorbing the next block when it is free and big enough, */
+/*   or by growing the arena when the block is the last one */
+/* - Resize a direct mapping with mremap while it stays above mmap_threshold */
+/* - Otherwise allocate a new block, copy the payload over and free the old one */
+/* Safe to call from several threads at once */
+void *Mem_Realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) {
+        return Mem_Alloc(size);
+    }
+    long block_size = requestSize(size);
+    if (block_size < 0) {
+        return NULL;
+    }
+
+    mem_arena *arena = getArena(ptr);
+    long old_size;
+    slab_header *slab = getSlab(arena, ptr);
+    if (arena == NULL) {
+        pthread_mutex_lock(&mmap_lock);
+        int found = tableFind(&mmap_table, ptr) >= 0;
+        pthread_mutex_unlock(&mmap_lock);
+        if (!found) {
+            return NULL;
+        }
+        old_size = getSize((block_header *)ptr - 1);
+        //A direct mapping stays one while it is large, the kernel moves the pages
+        if (mmap_threshold > 0 && block_size >= mmap_threshold) {
+            return traceResize(ptr, countResize(old_size, mmapResize(ptr, block_size)), size);
+        }
+        //Only what fits in the new, smaller block is copied
+        if (old_size > (long)size) {
+            old_size = (long)size;
+        }
+    }
+    else if (slab != NULL) {
+        if (slabBusySlot(slab, ptr) < 0 || tcacheHolds(ptr, slab->size)) {
+            return NULL;
+        }
+        if (size <= (size_t)slab->size) {
+            return traceResize(ptr, ptr, size);
+        }
+        old_size = slab->size;
+    }
+    else {
+        block_header *req_pointer = getHeader(arena, ptr);
+        if (req_pointer == NULL) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&arena->lock);
+        if (!isBusy(req_pointer) || tcacheHolds(ptr, getSize(req_pointer))) {
+            pthread_mutex_unlock(&arena->lock);
+            return NULL;
+        }
+        old_size = getSize(req_pointer);
+        //A buddy block only grows by merging with its upper buddies
+        block_header *next_pointer = getNext(req_pointer);
+        if (arena->fit == 4 && getSize(req_pointer) < block_size) {
+            buddyGrow(arena, req_pointer, block_size);
+        }
+        //The last block can take new memory mapped right after it, and so can
+        //the block before a free last block, which the new memory extends
+        if (arena->fit != 4 && getSize(req_pointer) < block_size) {
+            long missing = block_size - getSize(req_pointer);
+            int last = getNext(next_pointer) == NULL;
+            if (!last && isFree(next_pointer) && getNext(getNext(next_pointer)) == NULL) {
+                missing = missing - (long)sizeof(block_header) - getSize(next_pointer);
+                last = 1;
+            }
+            if (last && missing > 0) {
+                growArena(arena, missing);
+                next_pointer = getNext(req_pointer);
+            }
+        }
+        //Absorb the next block when that makes room
+        if (arena->fit != 4 && getSize(req_pointer) < block_size && isFree(next_pointer)
+            && getSize(req_pointer) + (long)sizeof(block_header) + getSize(next_pointer) >= block_size) {
+            removeFree(arena, next_pointer);
+            combine(req_pointer, next_pointer);
+            getNext(req_pointer)->size_status &= ~PREV_FREE;
+        }
+        if (getSize(req_pointer) >= block_size) {
+            trimBlock(arena, req_pointer, block_size);
+            touchBlock(arena, req_pointer);
+            pthread_mutex_unlock(&arena->lock);
+            return traceResize(ptr, countResize(old_size, ptr), size);
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    //No room in place, move the payload
+    void *moved = allocObject(size);
+    if (moved == NULL) {
+        return NULL;
+    }
+    memcpy(moved, ptr, old_size);
+    freeObject(ptr);
+    return traceResize(ptr, moved, size);
+}
+
+/* Function for finding out how many bytes a block can hold */
+/* Argument - ptr: Address of the block */
+/* Returns its usable size, which is at least the size it was asked for */
+/* Returns 0 if ptr is not pointing to the first byte of a busy block or slab slot, */
+/* or if it has been freed into a thread cache */
+/* Safe to call from several threads at once */
+size_t Mem_UsableSize(void *ptr)
+{
+    if (ptr == NULL) {
+        return 0;
+    }
+    mem_arena *arena = getArena(ptr);
+    if (arena == NULL) {
+        pthread_mutex_lock(&mmap_lock);
+        int found = tableFind(&mmap_table, ptr) >= 0;
+        pthread_mutex_unlock(&mmap_lock);
+        return found ? (size_t)getSize((block_header *)ptr - 1) : 0;
+    }
+    slab_header *slab = getSlab(arena, ptr);
+    if (slab != NULL) {
+        return slabBusySlot(slab, ptr) < 0 || tcacheHolds(ptr, slab->size) ? 0 : (size_t)slab->size;
+    }
+    block_header *header = getHeader(arena, ptr);
+    if (header == NULL) {
+        return 0;
+    }
+    block_header seen = loadHeader(header);
+    return isBusy(&seen) && !tcacheHolds(ptr, getSize(&seen)) ? (size_t)getSize(&seen) : 0;
+}
+
+/* Function for allocating 'count' blocks of 'size' bytes each */
+/* Argument - out: receives the addresses of the blocks, room for 'count' of them */
+/* Returns the number of blocks allocated, which is less than 'count' only when */
+/* memory runs out. The blocks are freed with Mem_Free or Mem_FreeBatch */
+/* Here is what this function should accomplish */
+/* - Return 0 if size is not sane */
+/* - Small sizes come from the thread cache and then from slabs under one lock hold */
+/* - Sizes of mmap_threshold bytes or more are mapped one by one */
+/* - Otherwise carve the whole batch from as few free blocks as possible */
+/* - Whatever is still missing is allocated one by one, which may grow the heap */
+/* Safe to call from several threads at once */
+size_t Mem_AllocBatch(size_t count, size_t size, void **out)
+{
+    long block_size = requestSize(size);
+    if (block_size < 0 || out == NULL) {
+        return 0;
+    }
+    size_t done = 0;
+    size_t cached = 0;
+    mem_arena *arena = threadArena();
+
+    int i = tcacheClass(size);
+    if (i >= 0) {
+        while (done < count && tcache.counts[i] > 0) {
+            out[done++] = countCachedAlloc(tcachePop(&tcache, i));
+        }
+        cached = done;
+        pthread_mutex_lock(&arena->lock);
+        while (done < count) {
+            void *object = slabAlloc(arena, i);
+            if (object == NULL) {
+                break;
+            }
+            out[done++] = object;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+    else if (mmap_threshold == 0 || block_size < mmap_threshold) {
+        pthread_mutex_lock(&arena->lock);
+        done = (size_t)allocBatch(arena, block_size, (long)count, out);
+        pthread_mutex_unlock(&arena->lock);
+    }
+    for (size_t k = cached; k < done; k++) {
+        countAlloc(out[k]);
+    }
+
+    //The rest one at a time, from the other arenas or from new memory
+    while (done < count) {
+        out[done] = allocObject(size);
+        if (out[done] == NULL) {
+            break;
+        }
+        done++;
+    }
+    for (size_t k = 0; k < done && trace_fd >= 0; k++) {
+        traceAlloc(out[k], size);
+    }
+    return done;
+}
+
+/* Function for freeing 'count' blocks at once */
+/* Argument - ptrs: addresses of the blocks, the array itself is left as it is */
+/* Returns 0 when every block was freed */
+/* Returns -1 when one of them could not be, the others are freed regardless */
+/* Here is what this function should accomplish */
+/* - Small blocks, slab slots and direct mappings are freed as by Mem_Free */
+/* - Sort the remaining blocks by address, BATCH_MAX at a time */
+/* - Lock each arena once, and merge blocks that follow each other before */
+/*   freeing the run, so it is coalesced with its neighbours only once */
+/* Safe to call from several threads at once */
+int Mem_FreeBatch(void **ptrs, size_t count)
+{
+    void *sorted[BATCH_MAX];
+    int result = 0;
+
+    if (ptrs == NULL) {
+        return -1;
+    }
+    for (size_t k = 0; k < count && trace_fd >= 0; k++) {
+        traceFree(ptrs[k]);
+    }
+    for (size_t start = 0; start < count; start = start + BATCH_MAX) {
+        long n = 0;
+        for (size_t k = start; k < count && k < start + BATCH_MAX; k++) {
+            if (isBatchBlock(ptrs[k])) {
+                sorted[n++] = ptrs[k];
+            }
+            else if (freeObject(ptrs[k]) != 0) {
+                result = -1;
+            }
+        }
+        qsort(sorted, (size_t)n, sizeof(void *), comparePointers);
+        if (freeSorted(sorted, n) != 0) {
+            result = -1;
+        }
+    }
+    return result;
+}
+
+/* Function for reading the heap statistics without walking the heap */
+/* Argument - stats: filled in, see mem_stats in mem.h */
+/* Returns 0 on success */
+/* Returns -1 if stats is NULL or Mem_Init has not been called */
+/* Here is what this function should accomplish */
+/* - Add up the counters of the live threads and of those that exited */
+/* - Add up the free block and search counters of every arena, under its lock */
+/* - Take the largest free block from the policy's index (first fit has none */
+/*   and walks its block list for it, TLSF walks the list of its highest class) */
+/* - Count the objects waiting in thread caches and the free slab slots as */
+/*   free rather than in use */
+/* Other threads may be allocating meanwhile, the figures are then a close */
+/* approximation rather than a snapshot */
+/* Safe to call from several threads at once */
+int Mem_GetStats(mem_stats *stats)
+{
+    if (stats == NULL || region_base == NULL) {
+        return -1;
+    }
+    long allocs, frees, failures, in_use_bytes, cached_bytes;
+    long free_bytes = 0, free_blocks = 0, largest = 0;
+    long walk_calls = 0, walk_steps = 0, walk_max = 0;
+    long footprint = 0;
+
+    pthread_mutex_lock(&caches_lock);
+    allocs = retired_cache.allocs;
+    frees = retired_cache.frees;
+    failures = retired_cache.failures;
+    in_use_bytes = retired_cache.in_use_bytes;
+    cached_bytes = 0;
+    for (thread_cache *cache = live_caches; cache != NULL; cache = cache->next_cache) {
+        allocs = allocs + cache->allocs;
+        frees = frees + cache->frees;
+        failures = failures + cache->failures;
+        in_use_bytes = in_use_bytes + cache->in_use_bytes;
+        cached_bytes = cached_bytes + cache->cached_bytes;
+    }
+    in_use_bytes = in_use_bytes - cached_bytes;
+    free_bytes = cached_bytes;
+    pthread_mutex_unlock(&caches_lock);
+
+    for (int a = 0; a < arena_count; a++) {
+        mem_arena *arena = &arenas[a];
+        pthread_mutex_lock(&arena->lock);
+        free_bytes = free_bytes + arena->free_bytes + arena->slab_free_bytes;
+        free_blocks = free_blocks + arena->free_blocks;
+        footprint = footprint + (arena->region_end - arena->region_start);
+        long arena_largest = largestFree(arena);
+        if (arena_largest > largest) {
+            largest = arena_largest;
+        }
+        walk_calls = walk_calls + arena->walk_calls;
+        walk_steps = walk_steps + arena->walk_steps;
+        if (arena->walk_max > walk_max) {
+            walk_max = arena->walk_max;
+        }
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    //Counters of other threads are read on the fly, do not let them go below zero
+    stats->in_use_blocks = allocs > frees ? (size_t)(allocs - frees) : 0;
+    stats->in_use_bytes = in_use_bytes > 0 ? (size_t)in_use_bytes : 0;
+    stats->free_blocks = (size_t)free_blocks;
+    stats->free_bytes = (size_t)free_bytes;
+    stats->largest_free = (size_t)largest;
+    stats->fragmentation = free_bytes > 0 ? 1.0 - (double)largest / (double)free_bytes : 0.0;
+    pthread_mutex_lock(&mmap_lock);
+    stats->mapped_blocks = (size_t)mmap_table.count;
+    stats->mapped_bytes = (size_t)mmap_bytes;
+    stats->footprint = (size_t)(footprint + mmap_bytes);
+    pthread_mutex_unlock(&mmap_lock);
+    stats->allocs = (unsigned long)allocs;
+    stats->frees = (unsigned long)frees;
+    stats->failures = (unsigned long)failures;
+    stats->avg_walk = walk_calls > 0 ? (double)walk_steps / (double)walk_calls : 0.0;
+    stats->max_walk = (unsigned long)walk_max;
+    return 0;
+}
+
+/* Function for recording allocations and frees to a trace file */
+/* Argument - path: file to write the trace to, NULL stops recording */
+/* Returns 0 on success */
+/* Returns -1 if the file cannot be created */
+/* Here is what this function should accomplish */
+/* - Finish the trace being recorded, if any */
+/* - Start the new file with a header event (op 0, id MEM_TRACE_VERSION and */
+/*   size MEM_TRACE_MAGIC), ids start again at 1 */
+/* - Make sure the trace is finished when the program exits */
+/* Only objects allocated while recording are traced, frees of older ones are */
+/* left out. Mem_Init starts a trace by itself when MEM_TRACE names a file */
+/* Safe to call from several threads at once */
+int Mem_Trace(const char *path)
+{
+    int result = 0;
+    int started = 0;
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0) {
+        traceFlush();
+        close(trace_fd);
+        trace_fd = -1;
+        if (trace_ids.entries != NULL) {
+            munmap(trace_ids.entries, trace_ids.capacity * sizeof(table_entry));
+        }
+        memset(&trace_ids, 0, sizeof(trace_ids));
+    }
+    if (path != NULL) {
+        trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (trace_fd < 0) {
+            result = -1;
+        }
+        else {
+            trace_next_id = 1;
+            traceWrite(0, MEM_TRACE_VERSION, MEM_TRACE_MAGIC);
+            started = 1;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    //atexit may allocate, which is traced, so not under trace_lock
+    if (started && !trace_exit_registered) {
+        trace_exit_registered = 1;
+        atexit(traceExit);
+    }
+    return result;
+}
+
+/* Heaps */
+/* Besides the process heap of Mem_Init, a program can create heaps of its */
+/* own, as many as it likes. A heap is an arena with a region and a policy of */
+/* its own; its descriptor sits in the first pages of the mapping, in front of */
+/* the region. Every request is served from the region under the heap's lock: */
+/* no thread cache, no slabs and no direct mappings, so nothing a heap hands */
+/* out lives anywhere else and Mem_HeapReset can take it all back at once. */
+/* A heap does not grow, and its calls are not traced. */
+
+/* Empties the free indexes and the quick lists of 'heap', without looking at */
+/* its blocks. Tables of a fixed size are cleared, so the cost is constant */
+void heapClear(mem_arena *heap)
+{
+    heap->tlsf_fl_bitmap = 0;
+    memset(heap->tlsf_sl_bitmap, 0, sizeof(heap->tlsf_sl_bitmap));
+    memset(heap->tlsf_free, 0, sizeof(heap->tlsf_free));
+    heap->tree_root = NULL;
+    heap->buddy_bitmap = 0;
+    memset(heap->buddy_free, 0, sizeof(heap->buddy_free));
+    heap->heap_count = 0;
+    memset(heap->quick, 0, sizeof(heap->quick));
+    memset(heap->quick_counts, 0, sizeof(heap->quick_counts));
+    heap->quick_total = 0;
+    heap->free_bytes = 0;
+    heap->free_blocks = 0;
+}
+
+/* Function used to create a heap */
+/* Argument - sizeOfRegion: Specifies the size of the region of the heap
+            policy: allocation policy of the heap, as for Mem_Init */
+/* Mem_Init is not needed first */
+/* Returns the heap on success and NULL on failure */
+mem_heap *Mem_HeapCreate(size_t sizeOfRegion, int policy)
+{
+    long pagesize = getpagesize();
+    long region_size;
+    long header_size;
+    int fd;
+    void *space_ptr;
+
+    if (sizeOfRegion == 0 || sizeOfRegion > MEM_MAX_REGION)
+    {
+        fprintf(stderr, "Error:mem.c: Requested heap size is not valid\n");
+        return NULL;
+    }
+    if (policy < 0 || policy > 4)
+    {
+        fprintf(stderr, "Error:mem.c: Unknown allocation policy\n");
+        return NULL;
+    }
+    region_size = ((long)sizeOfRegion + pagesize - 1) / pagesize * pagesize;
+    header_size = ((long)sizeof(mem_arena) + pagesize - 1) / pagesize * pagesize;
+
+    fd = open("/dev/zero", O_RDWR);
+    if (-1 == fd)
+    {
+        fprintf(stderr, "Error:mem.c: Cannot open /dev/zero\n");
+        return NULL;
+    }
+    space_ptr = mmap(NULL, header_size + region_size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_NORESERVE, fd, 0);
+    if (MAP_FAILED == space_ptr)
+    {
+        fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
+        close(fd);
+        return NULL;
+    }
+
+    //The mapping is zero, so is every field not set here
+    mem_arena *heap = (mem_arena *)space_ptr;
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->fit = policy;
+    heap->region_start = (char *)space_ptr + header_size;
+    heap->region_end = heap->region_start + region_size;
+    if (policy == 2 && heapSetup(heap, region_size, fd) != 0)
+    {
+        fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
+        munmap(space_ptr, header_size + region_size);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    arenaFormat(heap);
+    heapLink(heap);
+    return heap;
+}
+
+/* Function for allocating 'size' bytes from 'heap' */
+/* Returns address of allocated block on success */
+/* Returns NULL on failure */
+/* The block is freed with Mem_HeapFree on the same heap, or by Mem_HeapReset */
+/* Safe to call from several threads at once */
+void *Mem_HeapAlloc(mem_heap *heap, size_t size)
+{
+    long block_size = requestSize(size);
+    if (heap == NULL || block_size < 0)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&heap->lock);
+    block_header *found = allocBlock(heap, block_size);
+    pthread_mutex_unlock(&heap->lock);
+    return found == NULL ? NULL : found + 1;
+}
+
+/* Function for freeing up a block allocated from 'heap' */
+/* Returns 0 on success */
+/* Returns -1 when ptr is not pointing to the first byte of a busy block of the heap */
+/* Safe to call from several threads at once */
+int Mem_HeapFree(mem_heap *heap, void *ptr)
+{
+    if (heap == NULL || ptr == NULL)
+    {
+        return -1;
+    }
+    block_header *req_pointer = getHeader(heap, ptr);
+    if (req_pointer == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&heap->lock);
+    if (!isBusy(req_pointer))
+    {
+        pthread_mutex_unlock(&heap->lock);
+        return -1;
+    }
+    if (heap->root == (char *)ptr - heap->region_start)
+    {
+        heap->root = 0;
+    }
+    deferFree(heap, req_pointer);
+    pthread_mutex_unlock(&heap->lock);
+    return 0;
+}
+
+/* Function for freeing every block of 'heap' at once */
+/* Returns 0 on success and -1 on failure */
+/* Here is what this function should accomplish */
+/* - Empty the free indexes and the quick lists of the heap */
+/* - Reinstall one big free block over the region, as Mem_HeapCreate left it */
+/*   (the buddy system lays out its O(log n) blocks again instead) */
+/* - Nothing is visited block by block, so the cost does not depend on how many */
+/*   blocks are in use. Pointers handed out before must not be used again, */
+/*   the root object included. Mem_HeapFree rejects them through the header */
+/*   cookie, which compact headers do not have */
+/* Safe to call from several threads at once */
+int Mem_HeapReset(mem_heap *heap)
+{
+    if (heap == NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&heap->lock);
+    heapClear(heap);
+    //Headers handed out before no longer pass for blocks
+    heap->generation++;
+    arenaFormat(heap);
+    heap->root = 0;
+    //Blocks handed out before have been written to, none of the region is clean
+    heap->clean = heap->region_end;
+    pthread_mutex_unlock(&heap->lock);
+    return 0;
+}
+
+/* Function for giving the whole of 'heap' back to the OS */
+/* Every block of the heap goes with it, and the heap must not be used again */
+/* A heap opened from a file is shut down cleanly instead: its blocks are */
+/* written back to the file and it is marked clean, see Mem_HeapOpen */
+/* Returns 0 on success and -1 on failure */
+int Mem_HeapDestroy(mem_heap *heap)
+{
+    if (heap == NULL)
+    {
+        return -1;
+    }
+    heapUnlink(heap);
+    if (heap->file != NULL)
+    {
+        return heapClose(heap);
+    }
+    if (heap->heap_array != NULL)
+    {
+        munmap(heap->heap_array,
+            heapCapacity(heap->region_end - heap->region_start) * sizeof(block_header *));
+    }
+    pthread_mutex_destroy(&heap->lock);
+    return munmap(heap, heap->region_end - (char *)heap);
+}
+
+/* Function for making 'ptr' the root object of 'heap' */
+/* The root is how a program finds its data again once Mem_HeapOpen has */
+/* reopened the heap; it is kept as an offset, which holds wherever the */
+/* heap is mapped */
+/* Argument - ptr: a busy block of the heap, or NULL for no root */
+/* Returns 0 on success and -1 when ptr is not a busy block of the heap */
+int Mem_HeapSetRoot(mem_heap *heap, void *ptr)
+{
+    if (heap == NULL)
+    {
+        return -1;
+    }
+    block_header *header = NULL;
+    if (ptr != NULL)
+    {
+        header = getHeader(heap, ptr);
+        if (header == NULL)
+        {
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&heap->lock);
+    if (header != NULL && !isBusy(header))
+    {
+        pthread_mutex_unlock(&heap->lock);
+        return -1;
+    }
+    heap->root = ptr == NULL ? 0 : (char *)ptr - heap->region_start;
+    pthread_mutex_unlock(&heap->lock);
+    return 0;
+}
+
+/* Returns the root object of 'heap', or NULL when it has none */
+void *Mem_HeapGetRoot(mem_heap *heap)
+{
+    if (heap == NULL || heap->root == 0)
+    {
+        return NULL;
+    }
+    return heap->region_start + heap->root;
+}
+
+/* Heap files */
+/* Mem_HeapOpen maps a heap from a file with MAP_SHARED, so that what a program */
+/* builds in it is there again when the file is opened by the next run. The */
+/* file holds, each rounded up to whole pages: a heap_file header and the */
+/* descriptor of the heap, the heap array under worst fit, and the region. */
+/* Block links are offsets, so the block list is valid wherever the file is */
+/* mapped. The rest (cookies, footers, free indexes and the pointers of the */
+/* descriptor) holds addresses, so a heap is reopened at the address it had */
+/* whenever the kernel allows it. When it does, and the heap was shut down */
+/* cleanly, the heap is ready right away; otherwise everything that depends */
+/* on addresses is derived again in one pass over the block list. */
+#define HEAP_FILE_MAGIC 0x50414548504d454dUL /* "MEMPHEAP" */
+#define HEAP_FILE_VERSION 1
+
+typedef struct heap_file_hd
+{
+    /* HEAP_FILE_MAGIC and HEAP_FILE_VERSION, and the sizes of the block */
+    /* header and the descriptor of the build that made the file; a build */
+    /* with another layout does not open it */
+    unsigned long magic;
+    unsigned int version;
+    unsigned int header_size;
+    unsigned long descriptor_size;
+    int policy;
+    /* 1 from a clean shutdown until the file is opened again */
+    int clean;
+    /* Bytes in front of the region, and the region itself */
+    long prefix_size;
+    long region_size;
+    /* Where the file was mapped the last time it was open */
+    char *base;
+} heap_file;
+
+/* Offset of the descriptor from the start of the file */
+#define HEAP_FILE_ARENA (((long)sizeof(heap_file) + 63) / 64 * 64)
+
+/* Bytes in front of the region of a heap file of 'region_size' bytes */
+long heapFilePrefix(int policy, long region_size)
+{
+    long pagesize = getpagesize();
+    long prefix = (HEAP_FILE_ARENA + (long)sizeof(mem_arena) + pagesize - 1) / pagesize * pagesize;
+    if (policy == 2)
+    {
+        prefix = prefix + (heapCapacity(region_size) * (long)sizeof(block_header *)
+            + pagesize - 1) / pagesize * pagesize;
+    }
+    return prefix;
+}
+
+/* Points the descriptor of the heap file mapped at 'file' at its own memory */
+void heapFileLayout(mem_arena *heap, heap_file *file)
+{
+    char *base = (char *)file;
+    long pagesize = getpagesize();
+    heap->region_start = base + file->prefix_size;
+    heap->region_end = heap->region_start + file->region_size;
+    heap->heap_array = NULL;
+    if (heap->fit == 2)
+    {
+        heap->heap_array = (block_header **)(base
+            + (HEAP_FILE_ARENA + (long)sizeof(mem_arena) + pagesize - 1) / pagesize * pagesize);
+    }
+}
+
+/* Files the free block 'run' of a heap being rebuilt, see heapRebuild */
+void heapRebuildFree(mem_arena *heap, block_header *run)
+{
+    setFooter(run);
+    if (heap->fit == 4 && run == heap->list_head)
+    {
+        //The lead block of the buddy system is on no list
+        heap->free_bytes = heap->free_bytes + getSize(run);
+        heap->free_blocks++;
+        return;
+    }
+    insertFree(heap, run);
+}
+
+/* Derives everything that depends on addresses again from the block list of */
+/* the heap file mapped at 'file': the descriptor, cookies, footers and free */
+/* indexes. Free neighbours left behind by a crash are merged, and blocks that */
+/* were queued for deferred coalescing are freed for good */
+/* Returns 0 on success and -1 when the block list does not hold up */
+int heapRebuild(mem_arena *heap, heap_file *file)
+{
+    heap->fit = file->policy;
+    heapFileLayout(heap, file);
+    heapClear(heap);
+    heap->list_head = (block_header *)(heap->region_start + SIZE_BIAS);
+    heap->clean = heap->region_end;
+
+    block_header *fence = (block_header *)heap->region_end - 1;
+    //Free block whose end has not been seen yet
+    block_header *run = NULL;
+    long queued = 0;
+    block_header *ptr = heap->list_head;
+    while (ptr != fence)
+    {
+        block_header *next = getNext(ptr);
+        //Every block has to end where the next one starts, the last one at the fence
+        if (next == NULL || next <= ptr || next > fence
+            || (char *)next != (char *)(ptr + 1) + getSize(ptr))
+        {
+            return -1;
+        }
+        if (isFree(ptr) && run != NULL && heap->fit != 4)
+        {
+            combine(run, ptr);
+            ptr = next;
+            continue;
+        }
+        //Only blocks that are still there once free runs are merged need a cookie
+        setMagic(heap, ptr);
+        setSize(ptr, getSize(ptr), (ptr->size_status & (MEM_ALIGN - 1) & ~PREV_FREE)
+            | (run != NULL ? PREV_FREE : 0));
+        if (run != NULL)
+        {
+            heapRebuildFree(heap, run);
+        }
+        run = isFree(ptr) ? ptr : NULL;
+        queued = queued + isQueued(ptr);
+        ptr = next;
+    }
+    if (getNext(fence) != NULL || isFree(fence))
+    {
+        return -1;
+    }
+    setFence(heap, fence);
+    if (run != NULL)
+    {
+        fence->size_status |= PREV_FREE;
+        heapRebuildFree(heap, run);
+    }
+
+    //Free blocks merged into a queued one are never queued themselves, so the
+    //first block after it that is not free is still there after freeBlock
+    for (ptr = heap->list_head; queued > 0 && ptr != fence;)
+    {
+        if (!isQueued(ptr))
+        {
+            ptr = getNext(ptr);
+            continue;
+        }
+        block_header *after = getNext(ptr);
+        while (after != fence && isFree(after))
+        {
+            after = getNext(after);
+        }
+        ptr->size_status &= ~QUEUED;
+        freeBlock(heap, ptr);
+        queued--;
+        ptr = after;
+    }
+    return 0;
+}
+
+/* Function used to open a heap kept in the file at 'path' */
+/* Argument - path: the file, created when it does not exist
+            sizeOfRegion: size of the region of a new file
+            policy: allocation policy of a new file, as for Mem_Init */
+/* A file that already holds a heap keeps its own size and policy, and the */
+/* heap comes back with every block as it was, see Mem_HeapGetRoot. Pointers */
+/* stored in the blocks stay valid when the file is mapped at its old address, */
+/* which is asked for; data that has to survive a move keeps offsets instead */
+/* The heap is used like one made by Mem_HeapCreate, by one process at a time, */
+/* and Mem_HeapDestroy shuts it down cleanly */
+/* Returns the heap on success and NULL on failure */
+mem_heap *Mem_HeapOpen(const char *path, size_t sizeOfRegion, int policy)
+{
+    heap_file header;
+    struct stat file_stat;
+    long pagesize = getpagesize();
+    long total;
+    int fd;
+    void *space_ptr;
+
+    if (path == NULL)
+    {
+        return NULL;
+    }
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == fd)
+    {
+        fprintf(stderr, "Error:mem.c: Cannot open %s\n", path);
+        return NULL;
+    }
+    //The lock goes away with the descriptor, so a crash cannot leave it behind
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0 || fstat(fd, &file_stat) != 0)
+    {
+        fprintf(stderr, "Error:mem.c: %s is in use\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    if (file_stat.st_size == 0)
+    {
+        if (sizeOfRegion == 0 || sizeOfRegion > MEM_MAX_REGION || policy < 0 || policy > 4)
+        {
+            fprintf(stderr, "Error:mem.c: Requested heap size or policy is not valid\n");
+            close(fd);
+            return NULL;
+        }
+        memset(&header, 0, sizeof(header));
+        header.region_size = ((long)sizeOfRegion + pagesize - 1) / pagesize * pagesize;
+        header.prefix_size = heapFilePrefix(policy, header.region_size);
+        header.policy = policy;
+    }
+    else if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+        || header.magic != HEAP_FILE_MAGIC || header.version != HEAP_FILE_VERSION
+        || header.header_size != sizeof(block_header) || header.descriptor_size != sizeof(mem_arena)
+        || header.policy < 0 || header.policy > 4
+        || header.region_size <= 0 || header.region_size > MEM_MAX_REGION
+        || header.prefix_size != heapFilePrefix(header.policy, header.region_size)
+        || file_stat.st_size != header.prefix_size + header.region_size)
+    {
+        fprintf(stderr, "Error:mem.c: %s is not a heap file of this build\n", path);
+        close(fd);
+        return NULL;
+    }
+    total = header.prefix_size + header.region_size;
+    if (file_stat.st_size == 0 && ftruncate(fd, total) != 0)
+    {
+        fprintf(stderr, "Error:mem.c: Cannot grow %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    //The address of the last run is only a hint, mappings already there win
+    space_ptr = mmap(header.base, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == space_ptr)
+    {
+        fprintf(stderr, "Error:mem.c: mmap cannot allocate space\n");
+        close(fd);
+        return NULL;
+    }
+    heap_file *file = (heap_file *)space_ptr;
+    mem_arena *heap = (mem_arena *)((char *)space_ptr + HEAP_FILE_ARENA);
+
+    if (file_stat.st_size == 0)
+    {
+        //The new file is zero, so is every field not set here
+        *file = header;
+        file->magic = HEAP_FILE_MAGIC;
+        file->version = HEAP_FILE_VERSION;
+        file->header_size = sizeof(block_header);
+        file->descriptor_size = sizeof(mem_arena);
+        heap->fit = policy;
+        heapFileLayout(heap, file);
+        arenaFormat(heap);
+    }
+    else if (!file->clean || (char *)space_ptr != file->base)
+    {
+        if (heapRebuild(heap, file) != 0)
+        {
+            fprintf(stderr, "Error:mem.c: %s is damaged\n", path);
+            munmap(space_ptr, total);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    pthread_mutex_init(&heap->lock, NULL);
+    heap->file = file;
+    heap->file_fd = fd;
+    file->base = (char *)space_ptr;
+    //Until Mem_HeapDestroy says otherwise, the file may be left half updated
+    file->clean = 0;
+    heapLink(heap);
+    return heap;
+}
+
+/* Shuts the heap file of 'heap' down cleanly, see Mem_HeapDestroy */
+/* Returns 0 on success and -1 when the file could not be written */
+int heapClose(mem_arena *heap)
+{
+    heap_file *file = heap->file;
+    int fd = heap->file_fd;
+    long total = heap->region_end - (char *)file;
+    int result = 0;
+
+    pthread_mutex_lock(&heap->lock);
+    //The queues are not worth keeping, merged blocks are
+    quickDrain(heap);
+    heap->file = NULL;
+    //The flag vouches for everything else, so it is written last
+    if (msync(file, total, MS_SYNC) != 0)
+    {
+        result = -1;
+    }
+    else
+    {
+        file->clean = 1;
+        result = msync(file, getpagesize(), MS_SYNC);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    pthread_mutex_destroy(&heap->lock);
+    munmap(file, total);
+    close(fd);
+    return result;
+}
+
+/* Bump arenas */
+/* For data that dies all at once, at the end of a request say: one block of */
+/* the process heap with a top pointer. An allocation moves the top up by the */
+/* size rounded to MEM_ALIGN, with no header, no search and no lock, and a mark */
+/* is just the offset of the top, so releasing back to it frees everything */
+/* allocated since in one store. Marks nest like the scopes that take them. */
+/* A bump arena belongs to one thread at a time and does not grow. */
+struct bump_hd
+{
+    char *top;
+    char *end;
+};
+
+/* Bytes in front of the first object, the descriptor rounded to MEM_ALIGN */
+#define BUMP_HEADER_SIZE ((sizeof(struct bump_hd) + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN)
+
+/* Function used to create a bump arena of 'size' bytes */
+/* Its memory is a block of the process heap, so Mem_Init must be called first */
+/* Returns the arena on success and NULL on failure */
+mem_bump *Mem_BumpCreate(size_t size)
+{
+    if (size == 0 || size > MEM_MAX_REGION)
+    {
+        return NULL;
+    }
+    size = (size + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN;
+    mem_bump *bump = (mem_bump *)traceAlloc(allocObject(BUMP_HEADER_SIZE + size),
+        BUMP_HEADER_SIZE + size);
+    if (bump == NULL)
+    {
+        return NULL;
+    }
+    bump->top = (char *)bump + BUMP_HEADER_SIZE;
+    bump->end = bump->top + size;
+    return bump;
+}
+
+/* Function for allocating 'size' bytes from 'bump' */
+/* Returns address of allocated memory on success, aligned to MEM_ALIGN (16) */
+/* Returns NULL when size is zero or the arena is full */
+/* The memory cannot be freed on its own, see Mem_BumpRelease */
+void *Mem_BumpAlloc(mem_bump *bump, size_t size)
+{
+    if (bump == NULL)
+    {
+        return NULL;
+    }
+    char *ptr = bump->top;
+    //A size that wraps around when rounded comes out as 0
+    size = (size + MEM_ALIGN - 1) & ~(size_t)(MEM_ALIGN - 1);
+    if (size == 0 || size > (size_t)(bump->end - ptr))
+    {
+        return NULL;
+    }
+    bump->top = ptr + size;
+    return ptr;
+}
+
+/* Function for saving the current position of 'bump' */
+/* Returns a mark to hand to Mem_BumpRelease */
+size_t Mem_BumpMark(mem_bump *bump)
+{
+    if (bump == NULL)
+    {
+        return 0;
+    }
+    return (size_t)(bump->top - (char *)bump);
+}
+
+/* Function for freeing everything allocated from 'bump' since 'mark' was taken */
+/* Marks taken after 'mark' are no longer valid, the ones taken before still are */
+/* Returns 0 on success and -1 when 'mark' is not a position of this arena */
+/* or lies past its current position */
+int Mem_BumpRelease(mem_bump *bump, size_t mark)
+{
+    if (bump == NULL || mark < BUMP_HEADER_SIZE || mark > (size_t)(bump->top - (char *)bump))
+    {
+        return -1;
+    }
+    bump->top = (char *)bump + mark;
+    return 0;
+}
+
+/* Function for giving the memory of 'bump' back to the process heap */
+/* Every object allocated from it goes with it */
+/* Returns 0 on success and -1 on failure */
+int Mem_BumpDestroy(mem_bump *bump)
+{
+    traceFree(bump);
+    return freeObject(bump);
+}
+
+/* Function to be used for debug */
+/* Prints out a list of all the blocks along with the following information for each block */
+/* No.      : Serial number of the block */
+/* Status   : free/busy */
+/* Begin    : Address of the first useful byte in the block */
+/* End      : Address of the last byte in the block */
+/* Size     : Size of the block (excluding the header) */
+/* t_Size   : Size of the block (including the header) */
+/* t_Begin  : Address of the first byte in the block (this is where the header starts) */
+/* With several arenas their block lists are printed one after the other */
+/* Direct mappings follow with status Mmap and are not part of the totals */
+/* With MEM_OPT_HUGE_PAGES it also reports how much of the region the kernel */
+/* actually backs with huge pages */
+void Mem_Dump()
+{
+    int counter;
+    block_header *current = NULL;
+    char *t_Begin = NULL;
+    char *Begin = NULL;
+    long Size;
+    long t_Size;
+    char *End = NULL;
+    long free_size;
+    long busy_size;
+    long total_size;
+    long mapped_size;
+    char status[7];
+
+    free_size = 0;
+    busy_size = 0;
+    total_size = 0;
+    mapped_size = 0;
+    counter = 1;
+    fprintf(stdout, "************************************Block list***********************************\n");
+    fprintf(stdout, "No.\tStatus\tBegin\t\tEnd\t\tSize\tt_Size\tt_Begin\n");
+    fprintf(stdout, "---------------------------------------------------------------------------------\n");
+    for (int i = 0; i < arena_count; i++)
+    {
+        mem_arena *arena = &arenas[i];
+        if (arena_count > 1)
+        {
+            fprintf(stdout, "Arena %d\n", i);
+        }
+        pthread_mutex_lock(&arena->lock);
+        mapped_size = mapped_size + (arena->region_end - arena->region_start);
+        current = arena->list_head;
+        while (NULL != current && getNext(current) != NULL) /*stop at the fence*/
+        {
+            t_Begin = (char *)current;
+            Begin = t_Begin + sizeof(block_header);
+            Size = getSize(current);
+            strcpy(status, "Free");
+            if (isQueued(current)) /*freed, waiting to be coalesced*/
+            {
+                strcpy(status, "Queued");
+                t_Size = Size + (long)sizeof(block_header);
+                free_size = free_size + t_Size;
             }
+            else if (!isFree(current)) /*LSB = 1 => busy block*/
+            {
+                strcpy(status, "Busy");
+                t_Size = Size + (long)sizeof(block_header);
+                busy_size = busy_size + t_Size;
+            }
+            else
+            {
+                t_Size = Size + (long)sizeof(block_header);
+                free_size = free_size + t_Size;
+            }
+            End = Begin + Size;
+            fprintf(stdout, "%d\t%s\t0x%08lx\t0x%08lx\t%ld\t%ld\t0x%08lx\n", counter, status, (unsigned long int)Begin,
+                (unsigned long int)End, Size, t_Size, (unsigned long int)t_Begin);
+            total_size = total_size + t_Size;
+            current = getNext(current);
+            counter = counter + 1;
         }
-        if (max == -1) {//No space in array
-            return NULL;
+        pthread_mutex_unlock(&arena->lock);
+    }
+    pthread_mutex_lock(&mmap_lock);
+    for (long i = 0; i < mmap_table.capacity; i++)
+    {
+        if (mmap_table.entries[i].key == NULL)
+        {
+            continue;
         }
+        Begin = (char *)mmap_table.entries[i].key;
+        t_Begin = mmapStart(Begin);
+        Size = getSize((block_header *)Begin - 1);
+        t_Size = mmapLength(Begin);
+        End = Begin + Size;
+        fprintf(stdout, "%d\t%s\t0x%08lx\t0x%08lx\t%ld\t%ld\t0x%08lx\n", counter, "Mmap", (unsigned long int)Begin,
+            (unsigned long int)End, Size, t_Size, (unsigned long int)t_Begin);
+        counter = counter + 1;
+    }
+    pthread_mutex_unlock(&mmap_lock);
+    fprintf(stdout, "---------------------------------------------------------------------------------\n");
+    fprintf(stdout, "*********************************************************************************\n");
 
-        //Search for largest max
-
-        for (int i = 0; i < array_size; i++) {
-            if ((array_list[i] % 2 ==0) && array_list[i] > max
-                && max >= size) {
-                max = array_list[i];
-            }
+    fprintf(stdout, "Total busy size = %ld\n", busy_size);
+    fprintf(stdout, "Total free size = %ld\n", free_size);
+    fprintf(stdout, "Total size = %ld\n", busy_size + free_size);
+    fprintf(stdout, "Total mapped directly = %ld\n", mmap_bytes);
+    if (huge_pages)
+    {
+        long huge_size = hugePageBytes();
+        if (huge_size < 0)
+        {
+            fprintf(stdout, "Huge pages = unknown\n");
         }
+        else
+        {
+            fprintf(stdout, "Huge pages = %ld of %ld bytes mapped\n", huge_size, mapped_size);
+        }
+    }
+    fprintf(stdout, "*********************************************************************************\n");
+    fflush(stdout);
+    return;
+}
 
-        //Placement obtained based on max & size;
-        //Placement obtained - Decide splitting 
-        int demand = size;
-        int available = max;
-        if (demand == available) {//The requirement is an exact fit
-        //filter through list for that position and allocate
-            counter = list_head;
-            while (counter != NULL) {
-                if (counter->size_status == size) {
-                    //Required position found
-                    //Allocate space
-                    size += 0x1; // indicate block is in use
-                    counter->size_status = size;
-                    return counter + 1;
-                }
-                counter = counter->next;
-            }
+#ifndef MEM_NO_MAIN
+/* Tests */
+/* Mem_Init sets the heap of a process up once, so every test below runs in */
+/* a child process of its own, once for each policy it covers, and main() */
+/* only checks how the child exited */
+
+/* Runs test(policy) in a child process and checks that it passed */
+void testInChild(void (*test)(int), int policy)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0)
+    {
+        test(policy);
+        exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/* Runs test(policy) for every allocation policy */
+void testEachPolicy(void (*test)(int))
+{
+    for (int policy = 0; policy <= 4; policy++)
+    {
+        testInChild(test, policy);
+    }
+}
 
+/* Walks the block list of 'arena' and checks what every policy keeps true: */
+/* the blocks tile the region up to the fence, a free block carries its */
+/* footer and the PREV_FREE bit of the block after it, and outside the buddy */
+/* system no two free blocks sit side by side. Nothing may use the arena */
+/* meanwhile */
+/* Returns the number of free blocks */
+int checkArena(mem_arena *arena)
+{
+    block_header *ptr = arena->list_head;
+    int free_blocks = 0;
+    int prev_free = 0;
+    while (getNext(ptr) != NULL)
+    {
+        assert((char *)getNext(ptr) == (char *)(ptr + 1) + getSize(ptr));
+        assert(((ptr->size_status & PREV_FREE) != 0) == prev_free);
+        if (isFree(ptr))
+        {
+            assert(*getFooter(ptr) == ptr);
+            assert(!prev_free || arena->fit == 4);
+            free_blocks++;
         }
-        else if (available < (demand + sizeof(list_head) + sizeof(list_head)/2)) {
-            //Not enough space to spill, enough to allocate
-            //size += 0x1; // indicate block is in use
+        prev_free = isFree(ptr);
+        ptr = getNext(ptr);
+    }
+    assert((char *)(ptr + 1) == arena->region_end);
+    assert(((ptr->size_status & PREV_FREE) != 0) == prev_free);
+    return free_blocks;
+}
 
+/* A freed block merges with the free blocks on both sides of it */
+void testCoalesce(int policy)
+{
+    assert(Mem_Init(1 << 20, policy) == 0);
+    int free_blocks = checkArena(&arenas[0]);
+    void *ptr[4];
 
-            counter = list_head;
-            while (counter != NULL) {
+    for (int i = 0; i < 4; i++)
+    {
+        ptr[i] = Mem_Alloc(1000);
+        assert(ptr[i] != NULL);
+    }
+    assert(Mem_Free(ptr[0]) == 0);
+    assert(Mem_Free(ptr[2]) == 0);
+    checkArena(&arenas[0]);
+    assert(Mem_Free(ptr[1]) == 0);
+    int merged = checkArena(&arenas[0]);
+    //Buddies only merge with their buddies, the others make one block of three
+    if (policy != 4)
+    {
+        assert(merged == free_blocks + 1);
+        assert(getSize((block_header *)ptr[0] - 1) >= 3000);
+    }
+    assert(Mem_Free(ptr[3]) == 0);
+    assert(checkArena(&arenas[0]) == free_blocks);
+}
 
-                if (counter->size_status == size) {
-                    //Required position found
-                    //Allocate space
-                    size += 0x1; // indicate block is in use
-                    counter->size_status = counter->size_status + 1;
-                    return counter + 1;
-                }
-                counter = counter->next;
-            }
+/* Mem_Free takes the pointers it handed out, each of them once */
+void testValidate(int policy)
+{
+    int local;
+    assert(Mem_Init(1 << 20, policy) == 0);
+    char *block = Mem_Alloc(1000);
+    char *small = Mem_Alloc(40);
+    assert(block != NULL && small != NULL);
+
+    assert(Mem_Free(block + 16) == -1);
+    assert(Mem_Free(block + 500) == -1);
+    assert(Mem_Free(small + 8) == -1);
+    assert(Mem_Free(&local) == -1);
+    assert(Mem_Free(block) == 0);
+    assert(Mem_Free(block) == -1);
+    assert(Mem_Free(small) == 0);
+    assert(Mem_Free(small) == -1);
+    checkArena(&arenas[0]);
+}
 
+/* Best fit takes the smallest hole a request fits in */
+void testBestFit(int policy)
+{
+    int sizes[3] = {600, 300, 900};
+    void *holes[3];
+    assert(Mem_Init(1 << 20, policy) == 0);
 
-        }
-        else {
+    //Busy blocks between the holes keep them apart
+    for (int i = 0; i < 3; i++)
+    {
+        holes[i] = Mem_Alloc(sizes[i]);
+        assert(holes[i] != NULL && Mem_Alloc(400) != NULL);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        assert(Mem_Free(holes[i]) == 0);
+    }
+    assert(Mem_Alloc(280) == holes[1]);
+    assert(Mem_Alloc(580) == holes[0]);
+    assert(Mem_Alloc(880) == holes[2]);
+    checkArena(&arenas[0]);
+}
 
-            //Enough space for splitting
-            //Process of splitting
-            counter = list_head;
-            while (counter != NULL) {
-                if (counter->size_status == max) {
-                    // printf("--------mEEEEEEEEEE123------\n");
-                    // printf("--------max:%d------\n", size);
-                    //If block found do the process of splitting
-                    void *temp_pointer = (void *)counter;
-                    int size_counter = counter->size_status;
-                    block_header *new_block = (block_header *)(temp_pointer +
-                        size + sizeof(block_header));
-                    size += 0x1; // indicate block is in use
-                    counter->size_status = size;
-                    //Link the blocks
-                    block_header *next_block = counter->next;
-                    counter->next = new_block;
-                    //Two conditions-may be at end of list
-                    //1. new block is last block
-                    //2. new block in middle
-                    if (next_block == NULL) {//End of list
-                        // printf("-------------MEE---------\n");
-                        // printf("----------%d------------\n", size_counter);
-                        new_block->next=NULL;
-                        new_block->size_status = size_counter -
-                            sizeof(block_header) - (size-1);
-                        return counter + 1;
-                    }
-                    else { //Not end of list
-                    //Check after remove()!!!!!
-                        // printf("-------------MEE!!!---------\n");
-                        new_block->next = counter->next;
-                        void *start_p = (void *)counter;
-                        void *end_p = (void *)counter->next;
-                        new_block->size_status = (end_p - start_p) -
-                            2*sizeof(block_header) - (size-1);
-                        return counter + 1;
-                    }
+/* Worst fit takes the largest free block, which tops the max-heap */
+void testWorstFit(int policy)
+{
+    int sizes[3] = {600, 300, 900};
+    void *holes[3];
+    assert(Mem_Init(8192, policy) == 0);
+    mem_arena *arena = &arenas[0];
 
-                }
+    for (int i = 0; i < 3; i++)
+    {
+        holes[i] = Mem_Alloc(sizes[i]);
+        assert(holes[i] != NULL && Mem_Alloc(400) != NULL);
+    }
+    //Use up the rest of the region, then open the holes
+    assert(Mem_Alloc(getSize(arena->heap_array[0])) != NULL);
+    for (int i = 0; i < 3; i++)
+    {
+        assert(Mem_Free(holes[i]) == 0);
+    }
+    for (int i = 1; i < arena->heap_count; i++)
+    {
+        assert(getSize(arena->heap_array[(i - 1) / 2]) >= getSize(arena->heap_array[i]));
+    }
+    assert(Mem_Alloc(300) == holes[2]);
+    checkArena(arena);
+}
 
-                counter = counter->next;
-            }
+/* TLSF rounds a request up to the next class boundary, so it skips a block */
+/* of its own class that might be too small, and the bit of a class is set */
+/* exactly while the class list holds a block */
+void testTlsf(int policy)
+{
+    int fl, sl, large_sl;
+    assert(Mem_Init(1 << 20, policy) == 0);
+    mem_arena *arena = &arenas[0];
+
+    //Two holes in the 512..1023 bytes level, kept apart by busy blocks
+    char *small = Mem_Alloc(528);
+    assert(small != NULL && Mem_Alloc(400) != NULL);
+    char *large = Mem_Alloc(600);
+    assert(large != NULL && Mem_Alloc(400) != NULL);
+    tlsfMapping(getSize((block_header *)large - 1), &fl, &large_sl);
+    tlsfMapping(getSize((block_header *)small - 1), &fl, &sl);
+    assert(sl == 0 && large_sl > 1);
+    assert((arena->tlsf_fl_bitmap & 1U << fl) == 0 && arena->tlsf_sl_bitmap[fl] == 0);
+    assert(Mem_Free(small) == 0);
+    assert(Mem_Free(large) == 0);
+    assert((arena->tlsf_fl_bitmap & 1U << fl) != 0);
+    assert(arena->tlsf_sl_bitmap[fl] == (1U << sl | 1U << large_sl));
+
+    //520 bytes would fit the small hole, but round up into the second class
+    assert(Mem_Alloc(520) == large);
+    assert(arena->tlsf_sl_bitmap[fl] == 1U << sl);
+    assert(Mem_Alloc(500) == small);
+    assert((arena->tlsf_fl_bitmap & 1U << fl) == 0 && arena->tlsf_sl_bitmap[fl] == 0);
+    assert(Mem_Free(small) == 0);
+    assert((arena->tlsf_fl_bitmap & 1U << fl) != 0 && arena->tlsf_sl_bitmap[fl] == 1U << sl);
+    checkArena(arena);
+}
 
-        }
+/* Allocates a small block on another thread, for testThreadCache */
+void *testCacheThread(void *arg)
+{
+    (void)arg;
+    return Mem_Alloc(64);
+}
 
+/* Frees 'arg' on another thread, for testThreadCache */
+void *testFreeThread(void *arg)
+{
+    return (void *)(long)Mem_Free(arg);
+}
 
+/* A freed small block waits in the cache of the thread and comes straight */
+/* back, a block allocated on another thread can be freed on this one, and */
+/* a cached block cannot be freed again from any thread */
+void testThreadCache(int policy)
+{
+    int i = tcacheClass(64);
+    pthread_t thread;
+    void *other;
+    void *result;
+    assert(Mem_Init(1 << 20, policy) == 0);
+
+    void *ptr = Mem_Alloc(64);
+    assert(ptr != NULL);
+    assert(Mem_Free(ptr) == 0);
+    assert(tcache.counts[i] == 1);
+    assert(Mem_Free(ptr) == -1);
+    assert(pthread_create(&thread, NULL, testFreeThread, ptr) == 0);
+    assert(pthread_join(thread, &result) == 0);
+    assert((long)result == -1);
+    assert(Mem_Alloc(64) == ptr);
+    assert(tcache.counts[i] == 0);
+
+    assert(pthread_create(&thread, NULL, testCacheThread, NULL) == 0);
+    assert(pthread_join(thread, &other) == 0);
+    assert(other != NULL && other != ptr);
+    assert(Mem_Free(other) == 0);
+    assert(Mem_Free(other) == -1);
+    assert(Mem_Free(ptr) == 0);
+}
 
+/* Allocates a block on another thread, for testArenas */
+void *testArenaThread(void *arg)
+{
+    (void)arg;
+    return Mem_Alloc(1000);
+}
 
-        break;
-    }
-    default:
-        break;
+/* Threads get the arenas round-robin, and a block goes back to the arena */
+/* it came from whichever thread frees it */
+void testArenas(int policy)
+{
+    void *ptr[4];
+    long free_bytes[4];
+    assert(Mem_SetOption(MEM_OPT_ARENAS, 4) == 0);
+    assert(Mem_Init(1 << 20, policy) == 0);
+    for (int i = 0; i < 4; i++)
+    {
+        free_bytes[i] = arenas[i].free_bytes;
     }
 
-    return 0;
-    /* Your code should go in here */
+    ptr[0] = Mem_Alloc(1000);
+    for (int i = 1; i < 4; i++)
+    {
+        pthread_t thread;
+        assert(pthread_create(&thread, NULL, testArenaThread, NULL) == 0);
+        assert(pthread_join(thread, &ptr[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        assert(ptr[i] != NULL && getArena(ptr[i]) == &arenas[i]);
+        assert(arenas[i].free_bytes < free_bytes[i]);
+        assert(Mem_Free(ptr[i]) == 0);
+        assert(arenas[i].free_bytes == free_bytes[i]);
+        checkArena(&arenas[i]);
+    }
+    assert(getArena(&ptr) == NULL);
 }
 
-block_header * combine(block_header *p1, block_header *p2) {
-    //By-pass p2- Combine
-    p1->next = p2->next;
-    p1->size_status = p1->size_status + p2->size_status + sizeof(block_header);
-    return p1;
+/* An arena maps more memory when nothing fits, up to its share of */
+/* MEM_OPT_MAX_FOOTPRINT */
+void testGrowth(int policy)
+{
+    char *ptr[16];
+    assert(Mem_SetOption(MEM_OPT_MAX_FOOTPRINT, 1 << 22) == 0);
+    assert(Mem_SetOption(MEM_OPT_MMAP_THRESHOLD, 0) == 0);
+    assert(Mem_Init(1 << 16, policy) == 0);
+    mem_arena *arena = &arenas[0];
+    char *end = arena->region_end;
+
+    for (int i = 0; i < 16; i++)
+    {
+        ptr[i] = Mem_Alloc(20000);
+        assert(ptr[i] != NULL);
+        memset(ptr[i], i, 20000);
+    }
+    assert(arena->region_end > end);
+    checkArena(arena);
+
+    //The last block, or the one before a free last block, grows in place
+    //into memory mapped after it, past the end of the region. Buddies only
+    //grow into their buddies
+    block_header *next = getNext((block_header *)ptr[15] - 1);
+    if (policy != 4 && (getNext(next) == NULL || (isFree(next) && getNext(getNext(next)) == NULL)))
+    {
+        assert(Mem_Realloc(ptr[15], arena->region_end - ptr[15] + 100000) == ptr[15]);
+    }
+    assert(Mem_Alloc(1 << 22) == NULL);
+    for (int i = 0; i < 16; i++)
+    {
+        assert(ptr[i][19999] == i);
+        assert(Mem_Free(ptr[i]) == 0);
+    }
+    assert(arena->region_end - arena->region_start <= 1 << 22);
+    //The buddy system keeps the grown region in power-of-two blocks
+    assert(checkArena(arena) == 1 || policy == 4);
 }
 
-int inList(void *ptr) {
-    void *math_pointer_start = (void *)list_head;
+/* Small objects are slots of slabs and carry no header, and an empty slab */
+/* goes back to the arena */
+void testSlabs(int policy)
+{
+    char *ptr[100];
+    assert(Mem_Init(1 << 20, policy) == 0);
+    mem_arena *arena = &arenas[0];
+    int free_blocks = checkArena(arena);
 
-    //To get last element in list
-    block_header *counter = list_head;
-    while (counter->next != NULL)
+    for (int i = 0; i < 100; i++)
     {
-        counter = counter->next;
-    }
-    int size_final = 0;
-    if (counter->size_status %2 != 0) {
-        size_final = counter->size_status - 1;
+        ptr[i] = Mem_Alloc(48);
+        assert(ptr[i] != NULL);
+        slab_header *slab = getSlab(arena, ptr[i]);
+        assert(slab != NULL && slab->size == 48);
+        assert((ptr[i] - slabSlot(slab, 0)) % 48 == 0);
     }
-    else
+    for (int i = 0; i < 100; i++)
     {
-        size_final = counter->size_status;
+        assert(Mem_Free(ptr[i]) == 0);
     }
-    void *math_pointer_end = (void *)(counter + 1) + size_final;
-    if (ptr > math_pointer_end || ptr < math_pointer_start) {
-        return 0;
+    //Once the thread cache hands them back
+    tcacheRelease(&tcache);
+    for (int i = 0; i < 100; i++)
+    {
+        assert(getSlab(arena, ptr[i]) == NULL);
     }
-    return 1;
+    assert(checkArena(arena) == free_blocks);
 }
 
-block_header * getPrevious(block_header * node) {
-    if (node == list_head)
+/* Mem_Realloc shrinks and grows in place where it can and moves otherwise */
+void testRealloc(int policy)
+{
+    assert(Mem_Init(1 << 20, policy) == 0);
+    char *ptr = Mem_Alloc(1000);
+    char *next = Mem_Alloc(1000);
+    char *last = Mem_Alloc(1000);
+    assert(ptr != NULL && next != NULL && last != NULL);
+    memset(ptr, 'r', 1000);
+
+    assert(Mem_Realloc(ptr, 500) == ptr);
+    assert(Mem_Free(next) == 0);
+    //Buddies only grow into their buddies
+    if (policy != 4)
     {
-        return NULL;
+        assert(Mem_Realloc(ptr, 1800) == ptr);
     }
-    block_header *previous = NULL;
-    block_header *find = list_head;
-    while (find->next != NULL)
+    char *moved = Mem_Realloc(ptr, 50000);
+    assert(moved != NULL && moved != ptr);
+    for (int i = 0; i < 500; i++)
     {
-        if (find->next == node) {
-            previous = find;
-            break;
+        assert(moved[i] == 'r');
+    }
+    assert(Mem_Free(ptr) == -1);
+    assert(Mem_Realloc(ptr, 100) == NULL);
+    //A small object freed into the thread cache is gone as well
+    char *small = Mem_Alloc(32);
+    assert(small != NULL && Mem_Free(small) == 0);
+    assert(Mem_Realloc(small, 200) == NULL);
+    assert(Mem_Free(moved) == 0);
+    assert(Mem_Free(last) == 0);
+    checkArena(&arenas[0]);
+}
+
+/* Mem_Calloc returns zeroed memory, also when it reuses a dirty block */
+void testCalloc(int policy)
+{
+    size_t sizes[3] = {100, 2000, 20000};
+    assert(Mem_Init(1 << 20, policy) == 0);
+
+    for (int i = 0; i < 3; i++)
+    {
+        char *ptr = Mem_Alloc(sizes[i]);
+        assert(ptr != NULL);
+        memset(ptr, 0xff, sizes[i]);
+        assert(Mem_Free(ptr) == 0);
+        char *zero = Mem_Calloc(1, sizes[i]);
+        assert(zero != NULL);
+        for (size_t k = 0; k < sizes[i]; k++)
+        {
+            assert(zero[k] == 0);
         }
-        find = find->next;
+        assert(Mem_Free(zero) == 0);
     }
-    return previous;
+    assert(Mem_Calloc((size_t)-1 / 2, 4) == NULL);
 }
 
-block_header * getNext(block_header * node) {
-    return node->next;
+/* Payloads are MEM_ALIGN aligned, Mem_AllocAligned goes further */
+void testAligned(int policy)
+{
+    int alignments[4] = {32, 64, 256, 4096};
+    assert(Mem_Init(1 << 20, policy) == 0);
+
+    for (int size = 1; size < 5000; size = size * 3)
+    {
+        void *ptr = Mem_Alloc(size);
+        assert(ptr != NULL && (unsigned long)ptr % MEM_ALIGN == 0);
+        assert(Mem_Free(ptr) == 0);
+    }
+    for (int i = 0; i < 4; i++)
+    {
+        void *ptr = Mem_AllocAligned(alignments[i], 300);
+        assert(ptr != NULL && (unsigned long)ptr % alignments[i] == 0);
+        assert(getSize((block_header *)ptr - 1) >= 300);
+        memset(ptr, i, 300);
+        assert(Mem_Free(ptr) == 0);
+    }
+    assert(Mem_AllocAligned(48, 100) == NULL);
+    checkArena(&arenas[0]);
 }
 
+/* Headers take 16 bytes, or 8 with MEM_COMPACT_HEADER, and blocks are laid */
+/* out end to end with them */
+void testHeader(int policy)
+{
+#ifdef MEM_COMPACT_HEADER
+    assert(sizeof(block_header) == 8);
+#else
+    assert(sizeof(block_header) == 16);
+#endif
+    assert(Mem_Init(1 << 20, policy) == 0);
+    char *ptr = Mem_Alloc(1000);
+    char *next = Mem_Alloc(1000);
+    assert(ptr != NULL && next != NULL);
+    assert((unsigned long)ptr % MEM_ALIGN == 0 && (unsigned long)next % MEM_ALIGN == 0);
+    if (policy != 4)
+    {
+        assert(next == ptr + getSize((block_header *)ptr - 1) + sizeof(block_header));
+    }
+    assert(getSize((block_header *)ptr - 1) >= 1000);
+    assert(Mem_Free(ptr + MEM_ALIGN) == -1);
+    assert(Mem_Free(ptr) == 0);
+    assert(Mem_Free(ptr) == -1);
+    assert(Mem_Free(next) == 0);
+    checkArena(&arenas[0]);
+}
 
+/* With MEM_OPT_HUGE_PAGES the region starts on a huge page */
+void testHugePages(int policy)
+{
+    assert(Mem_SetOption(MEM_OPT_HUGE_PAGES, 1) == 0);
+    assert(Mem_Init(4 << 20, policy) == 0);
+    assert((unsigned long)arenas[0].region_start % HUGE_PAGE_SIZE == 0);
+    char *ptr = Mem_Alloc(100000);
+    assert(ptr != NULL);
+    memset(ptr, 'h', 100000);
+    assert(Mem_Free(ptr) == 0);
+    checkArena(&arenas[0]);
+}
 
+/* Without compact headers a heap and a block can be larger than 4 GiB. */
+/* Buddies round the block up to 8 GiB, which the lead block keeps out of */
+/* the first half of the region */
+void testLargeRegion(int policy)
+{
+#ifndef MEM_COMPACT_HEADER
+    assert(Mem_SetOption(MEM_OPT_MMAP_THRESHOLD, 0) == 0);
+    assert(Mem_Init(policy == 4 ? 17L << 30 : 6L << 30, policy) == 0);
+    char *ptr = Mem_Alloc(5L << 30);
+    assert(ptr != NULL);
+    assert(getSize((block_header *)ptr - 1) >= 5L << 30);
+    ptr[(5L << 30) - 1] = 'x';
+    assert(Mem_Free(ptr) == 0);
+#else
+    (void)policy;
+#endif
+}
 
-/* Function for freeing up a previously allocated block */
-/* Argument - ptr: Address of the block to be freed up */
-/* Returns 0 on success */
-/* Returns -1 on failure */
-/* Here is what this function should accomplish */
-/* - Return -1 if ptr is NULL */
-/* - Return -1 if ptr is not pointing to the first byte of a busy block */
-/* - Mark the block as free */
-/* - Coalesce if one or both of the immediate neighbours are free */
-int Mem_Free(void *ptr)
+/* Requests of MEM_OPT_MMAP_THRESHOLD bytes or more get a mapping of their */
+/* own, which Mem_Realloc resizes and Mem_Free unmaps */
+void testDirectMap(int policy)
 {
-    block_header *req_pointer = (block_header*)(ptr - sizeof(block_header));
-    block_header *next_pointer = req_pointer;
-    block_header *prev_pointer = req_pointer;
+    assert(Mem_Init(1 << 20, policy) == 0);
+    char *ptr = Mem_Alloc(1 << 20);
+    assert(ptr != NULL && getArena(ptr) == NULL);
+    assert(mmap_table.count == 1);
+    assert(getSize((block_header *)ptr - 1) >= 1 << 20);
+    memset(ptr, 'm', 1 << 20);
+
+    char *grown = Mem_Realloc(ptr, 4 << 20);
+    assert(grown != NULL && grown[(1 << 20) - 1] == 'm');
+    char *aligned = Mem_AllocAligned(4096, 1 << 20);
+    assert(aligned != NULL && (unsigned long)aligned % 4096 == 0);
+    assert(getArena(aligned) == NULL && mmap_table.count == 2);
+
+    assert(Mem_Free(grown) == 0);
+    assert(Mem_Free(grown) == -1);
+    assert(Mem_Free(aligned) == 0);
+    assert(mmap_table.count == 0);
+}
 
-    //Null ptr return -1
-    if (ptr == NULL) {
-        return -1;
-    }
-    //Not in the list return -1
-    if (!inList(ptr)) {
-        return -1;
+/* Mem_AllocBatch hands out a whole batch and Mem_FreeBatch takes it back */
+void testBatch(int policy)
+{
+    void *ptr[32];
+    assert(Mem_Init(1 << 20, policy) == 0);
+
+    assert(Mem_AllocBatch(32, 500, ptr) == 32);
+    for (int i = 0; i < 32; i++)
+    {
+        assert(ptr[i] != NULL && (unsigned long)ptr[i] % MEM_ALIGN == 0);
+        assert(getSize((block_header *)ptr[i] - 1) >= 500);
+        memset(ptr[i], i, 500);
     }
-    //Already free return -1;
+    assert(Mem_FreeBatch(ptr, 32) == 0);
+    checkArena(&arenas[0]);
+
+    //Small objects are batched too, and a pointer given twice is freed once
+    assert(Mem_AllocBatch(32, 40, ptr) == 32);
+    void *twice = ptr[1];
+    ptr[1] = ptr[0];
+    assert(Mem_FreeBatch(ptr, 32) == -1);
+    assert(Mem_Free(ptr[0]) == -1);
+    assert(Mem_Free(twice) == 0);
+}
 
+/* Mem_GetStats follows allocations and frees, and thread caches and slabs */
+/* do not show as in use once everything is freed */
+void testStats(int policy)
+{
+    mem_stats stats;
+    void *ptr[20];
+    assert(Mem_GetStats(&stats) == -1);
+    assert(Mem_Init(1 << 20, policy) == 0);
+    assert(Mem_GetStats(NULL) == -1);
 
-    //if no such node return -1
-    if (req_pointer == NULL) {
-        return -1;
+    for (int i = 0; i < 20; i++)
+    {
+        ptr[i] = Mem_Alloc(i % 2 == 0 ? 1000 : 40);
+        assert(ptr[i] != NULL);
     }
-
-    //if already pointing to free block return -1
-    if (req_pointer->size_status %2 == 0) {
-        return -1;
+    void *big = Mem_Alloc(1 << 20);
+    assert(big != NULL);
+    assert(Mem_GetStats(&stats) == 0);
+    assert(stats.allocs == 21 && stats.frees == 0 && stats.in_use_blocks == 21);
+    assert(stats.in_use_bytes >= 10 * 1000 + 10 * 40 + (1 << 20));
+    assert(stats.mapped_blocks == 1 && stats.mapped_bytes >= 1 << 20);
+    assert(stats.largest_free > 0 && stats.largest_free <= stats.free_bytes);
+
+    for (int i = 0; i < 20; i++)
+    {
+        assert(Mem_Free(ptr[i]) == 0);
     }
-    req_pointer->size_status = req_pointer->size_status -1;
-
+    assert(Mem_Free(big) == 0);
+    assert(Mem_GetStats(&stats) == 0);
+    assert(stats.frees == 21 && stats.in_use_blocks == 0 && stats.in_use_bytes == 0);
+    assert(stats.mapped_blocks == 0 && stats.mapped_bytes == 0);
+    assert(stats.fragmentation >= 0.0 && stats.fragmentation < 1.0);
+    assert(stats.footprint >= 1 << 20);
+}
 
-    ///////free here
+/* Mem_Trace records every call with the logical id of its object */
+void testTrace(int policy)
+{
+    char path[] = "/tmp/mem_trace_XXXXXX";
+    mem_trace_event events[8];
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    assert(Mem_Init(1 << 20, policy) == 0);
+
+    assert(Mem_Trace(path) == 0);
+    void *ptr = Mem_Alloc(100);
+    void *aligned = Mem_AllocAligned(256, 300);
+    ptr = Mem_Realloc(ptr, 2000);
+    assert(Mem_Free(aligned) == 0);
+    assert(Mem_Free(ptr) == 0);
+    assert(Mem_Trace(NULL) == 0);
+    //Not recorded any more
+    assert(Mem_Free(Mem_Alloc(100)) == 0);
+
+    assert(read(fd, events, sizeof(events)) == 6 * sizeof(mem_trace_event));
+    assert(events[0].op == 0 && events[0].id == MEM_TRACE_VERSION && events[0].size == MEM_TRACE_MAGIC);
+    assert(events[1].op == MEM_TRACE_ALLOC && events[1].id == 1 && events[1].size == 100);
+    assert(events[2].op == (MEM_TRACE_ALLOC_ALIGNED | 8 << MEM_TRACE_OP_BITS));
+    assert(events[2].id == 2 && events[2].size == 300);
+    assert(events[3].op == MEM_TRACE_REALLOC && events[3].id == 1 && events[3].size == 2000);
+    assert(events[4].op == MEM_TRACE_FREE && events[4].id == 2);
+    assert(events[5].op == MEM_TRACE_FREE && events[5].id == 1);
+    close(fd);
+    unlink(path);
+}
 
-    block_header *next_pointer_tracker = req_pointer;
-    while (next_pointer_tracker != NULL) //Keep searchinf until 
+/* Allocates blocks of mixed sizes for another thread to free, the producer */
+/* side of the producer/consumer workload of bench.c */
+void *testProducerThread(void *arg)
+{
+    void **ptr = (void **)arg;
+    for (int i = 0; i < 1000; i++)
     {
+        ptr[i] = Mem_Alloc(16 + (i * 37) % 3000);
+        assert(ptr[i] != NULL);
+    }
+    return NULL;
+}
 
+/* Blocks freed by a thread other than the one that allocated them go back */
+/* to their arena, which is left consistent */
+void testCrossThread(int policy)
+{
+    void *ptr[1000];
+    pthread_t thread;
+    assert(Mem_SetOption(MEM_OPT_ARENAS, 2) == 0);
+    assert(Mem_Init(1 << 22, policy) == 0);
 
-        //&& next_pointer->size_status %2 == 0
-        if (next_pointer_tracker->size_status %2 == 0) {
-            next_pointer = next_pointer_tracker;
-        }
-        else
+    for (int round = 0; round < 4; round++)
+    {
+        assert(pthread_create(&thread, NULL, testProducerThread, ptr) == 0);
+        assert(pthread_join(thread, NULL) == 0);
+        for (int i = 0; i < 1000; i++)
         {
-            break;
+            assert(Mem_Free(ptr[i]) == 0);
         }
+    }
+    tcacheRelease(&tcache);
+    checkArena(&arenas[0]);
+    checkArena(&arenas[1]);
+}
 
-        next_pointer_tracker = getNext(next_pointer_tracker);
+/* Allocates and frees until told to stop, for testFork */
+void *testForkThread(void *arg)
+{
+    while (!__atomic_load_n((int *)arg, __ATOMIC_RELAXED))
+    {
+        assert(Mem_Free(Mem_Alloc(100)) == 0);
+        assert(Mem_Free(Mem_Alloc(5000)) == 0);
     }
+    return NULL;
+}
+
+/* A fork while another thread is in the allocator leaves the child with */
+/* a heap it can use */
+void testFork(int policy)
+{
+    int stop = 0;
+    pthread_t thread;
+    assert(Mem_Init(1 << 20, policy) == 0);
+    assert(pthread_create(&thread, NULL, testForkThread, &stop) == 0);
 
-    block_header *prev_pointer_tracker = req_pointer;
-    while (prev_pointer_tracker != NULL) //Keep searchinf until 
+    for (int i = 0; i < 20; i++)
     {
-        if (prev_pointer_tracker->size_status %2 == 0) {
-            prev_pointer = prev_pointer_tracker;
-        }
-        else
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0)
         {
-            break;
+            void *ptr = Mem_Alloc(5000);
+            _exit(ptr != NULL && Mem_Free(ptr) == 0 ? 0 : 1);
         }
-        //&& prev_pointer->size_status %2 == 0
-        prev_pointer_tracker = getPrevious(prev_pointer_tracker);
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
     }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    assert(pthread_join(thread, NULL) == 0);
+
+    //The shim answers malloc_usable_size with this
+    void *ptr = Mem_Alloc(1000);
+    assert(Mem_UsableSize(ptr) >= 1000);
+    assert(Mem_UsableSize(&stop) == 0);
+    assert(Mem_Free(ptr) == 0);
+    assert(Mem_UsableSize(ptr) == 0);
+    ptr = Mem_Alloc(32);
+    assert(Mem_UsableSize(ptr) >= 32);
+    assert(Mem_Free(ptr) == 0);
+    assert(Mem_UsableSize(ptr) == 0);
+}
 
-    //Merge all blocks from prev to next
-    if (prev_pointer != next_pointer) {
-        void *math_pointer_start = (void *)(prev_pointer+1);
-        void *math_pointer_end = (void *)(next_pointer+1) + next_pointer->size_status;
-        int new_size = math_pointer_end - math_pointer_start;
-        prev_pointer->next = next_pointer->next;
-        prev_pointer->size_status = new_size;
+/* With MEM_OPT_DEFER_COALESCE a freed block waits on a quick list for the */
+/* next request of its size, until the arena holds too many of them */
+void testDeferred(int policy)
+{
+    void *ptr[16];
+    assert(Mem_SetOption(MEM_OPT_DEFER_COALESCE, 8) == 0);
+    assert(Mem_Init(1 << 20, policy) == 0);
+    mem_arena *arena = &arenas[0];
 
-        return 0;
+    for (int i = 0; i < 16; i++)
+    {
+        ptr[i] = Mem_Alloc(1000);
+        assert(ptr[i] != NULL);
     }
+    assert(Mem_Free(ptr[0]) == 0);
+    assert(isQueued((block_header *)ptr[0] - 1));
+    assert(Mem_Free(ptr[0]) == -1);
+    assert(Mem_Alloc(1000) == ptr[0]);
 
-    //If prev===next = required pointer
-    //Implies only one block to free
-    //no coalescing
-    //prev_pointer->size_status = prev_pointer->size_status -1;
-    return 0;
+    for (int i = 0; i < 16; i++)
+    {
+        assert(Mem_Free(ptr[i]) == 0);
+        assert(arena->quick_total <= 8);
+    }
+    checkArena(arena);
+
+    //Blocks handed back by the thread cache are queued as well
+    void *small = Mem_Alloc(40);
+    assert(small != NULL && Mem_Free(small) == 0);
+    tcacheRelease(&tcache);
+    quickDrain(arena);
+    assert(arena->quick_total == 0);
+    checkArena(arena);
+}
 
-    //Forward direction 
+/* Buddy blocks span a power of two at a multiple of it, and freeing them */
+/* all merges every buddy back */
+void testBuddy(int policy)
+{
+    void *ptr[20];
+    assert(Mem_Init(1 << 20, policy) == 0);
+    mem_arena *arena = &arenas[0];
+    unsigned long bitmap = arena->buddy_bitmap;
 
+    for (int i = 0; i < 20; i++)
+    {
+        ptr[i] = Mem_Alloc(300 + i * 150);
+        assert(ptr[i] != NULL);
+        block_header *block = (block_header *)ptr[i] - 1;
+        long span = getSize(block) + (long)sizeof(block_header);
+        assert((span & (span - 1)) == 0);
+        assert(((char *)block - buddyBase(arena)) % span == 0);
+    }
+    for (int i = 0; i < 20; i++)
+    {
+        assert(Mem_Free(ptr[i]) == 0);
+    }
+    assert(arena->buddy_bitmap == bitmap);
+    checkArena(arena);
 }
 
-/* Function to be used for debug */
-/* Prints out a list of all the blocks along with the following information for each block */
-/* No.      : Serial number of the block */
-/* Status   : free/busy */
-/* Begin    : Address of the first useful byte in the block */
-/* End      : Address of the last byte in the block */
-/* Size     : Size of the block (excluding the header) */
-/* t_Size   : Size of the block (including the header) */
-/* t_Begin  : Address of the first byte in the block (this is where the header starts) */
-void Mem_Dump()
+/* Set to stop testHeapThread */
+int heap_thread_stop = 0;
+
+/* Allocates and frees in a heap until told to stop, for testHeaps */
+void *testHeapThread(void *arg)
 {
-    int counter;
-    block_header *current = NULL;
-    char *t_Begin = NULL;
-    char *Begin = NULL;
-    int Size;
-    int t_Size;
-    char *End = NULL;
-    int free_size;
-    int busy_size;
-    int total_size;
-    char status[5];
+    mem_heap *heap = (mem_heap *)arg;
+    while (!__atomic_load_n(&heap_thread_stop, __ATOMIC_RELAXED))
+    {
+        assert(Mem_HeapFree(heap, Mem_HeapAlloc(heap, 100)) == 0);
+    }
+    return NULL;
+}
 
-    free_size = 0;
-    busy_size = 0;
-    total_size = 0;
-    current = list_head;
-    counter = 1;
-    fprintf(stdout, "************************************Block list***********************************\n");
-    fprintf(stdout, "No.\tStatus\tBegin\t\tEnd\t\tSize\tt_Size\tt_Begin\n");
-    fprintf(stdout, "---------------------------------------------------------------------------------\n");
-    while (NULL != current)
+/* Heaps are independent of Mem_Init and of each other, do not grow, and */
+/* Mem_HeapReset frees everything in them at once */
+void testHeaps(int policy)
+{
+    void *ptr[10];
+    pthread_t thread;
+    mem_heap *heap = Mem_HeapCreate(1 << 16, policy);
+    mem_heap *other = Mem_HeapCreate(1 << 16, policy);
+    assert(heap != NULL && other != NULL);
+
+    for (int i = 0; i < 10; i++)
     {
-        t_Begin = (char *)current;
-        Begin = t_Begin + (int)sizeof(block_header);
-        Size = current->size_status;
-        strcpy(status, "Free");
-        if (Size & 1) /*LSB = 1 => busy block*/
-        {
-            strcpy(status, "Busy");
-            Size = Size - 1; /*Minus one for ignoring status in busy block*/
-            t_Size = Size + (int)sizeof(block_header);
-            busy_size = busy_size + t_Size;
-        }
-        else
+        ptr[i] = Mem_HeapAlloc(heap, 100 + i * 100);
+        assert(ptr[i] != NULL);
+        assert((char *)ptr[i] >= heap->region_start && (char *)ptr[i] < heap->region_end);
+    }
+    assert(Mem_HeapFree(other, ptr[0]) == -1);
+    assert(Mem_Free(ptr[0]) == -1);
+    assert(Mem_HeapFree(heap, ptr[0]) == 0);
+    assert(Mem_HeapFree(heap, ptr[0]) == -1);
+    assert(Mem_HeapAlloc(heap, 1 << 17) == NULL);
+    checkArena(heap);
+
+    assert(Mem_HeapReset(heap) == 0);
+    checkArena(heap);
+#ifndef MEM_COMPACT_HEADER
+    for (int i = 1; i < 10; i++)
+    {
+        assert(Mem_HeapFree(heap, ptr[i]) == -1);
+    }
+#endif
+    void *whole = Mem_HeapAlloc(heap, 30000);
+    assert(whole != NULL && Mem_HeapFree(heap, whole) == 0);
+
+    //A fork while another thread holds the lock of a heap
+    assert(pthread_create(&thread, NULL, testHeapThread, other) == 0);
+    for (int i = 0; i < 20; i++)
+    {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (pid == 0)
         {
-            t_Size = Size + (int)sizeof(block_header);
-            free_size = free_size + t_Size;
+            _exit(Mem_HeapAlloc(other, 100) != NULL ? 0 : 1);
         }
-        End = Begin + Size;
-        fprintf(stdout, "%d\t%s\t0x%08lx\t0x%08lx\t%d\t%d\t0x%08lx\n", counter, status, (unsigned long int)Begin,
-            (unsigned long int)End, Size, t_Size, (unsigned long int)t_Begin);
-        total_size = total_size + t_Size;
-        current = current->next;
-        counter = counter + 1;
+        int status;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
     }
-    fprintf(stdout, "---------------------------------------------------------------------------------\n");
-    fprintf(stdout, "*********************************************************************************\n");
+    __atomic_store_n(&heap_thread_stop, 1, __ATOMIC_RELAXED);
+    assert(pthread_join(thread, NULL) == 0);
 
-    fprintf(stdout, "Total busy size = %d\n", busy_size);
-    fprintf(stdout, "Total free size = %d\n", free_size);
-    fprintf(stdout, "Total size = %d\n", busy_size + free_size);
-    fprintf(stdout, "*********************************************************************************\n");
-    fflush(stdout);
-    return;
+    assert(Mem_HeapDestroy(other) == 0);
+    assert(Mem_HeapDestroy(heap) == 0);
+}
+
+/* A bump arena hands out memory back to back, and releasing a mark frees */
+/* everything allocated since */
+void testBump(int policy)
+{
+    assert(Mem_Init(1 << 20, policy) == 0);
+    mem_bump *bump = Mem_BumpCreate(4096);
+    assert(bump != NULL);
+
+    char *first = Mem_BumpAlloc(bump, 100);
+    size_t outer = Mem_BumpMark(bump);
+    char *second = Mem_BumpAlloc(bump, 200);
+    assert(first != NULL && second != NULL);
+    assert(second >= first + 100 && (unsigned long)second % MEM_ALIGN == 0);
+    size_t inner = Mem_BumpMark(bump);
+    char *third = Mem_BumpAlloc(bump, 300);
+    assert(third >= second + 200);
+
+    assert(Mem_BumpRelease(bump, inner) == 0);
+    assert(Mem_BumpAlloc(bump, 300) == third);
+    assert(Mem_BumpRelease(bump, outer) == 0);
+    assert(Mem_BumpAlloc(bump, 200) == second);
+    //Marks past the top, and the bump arena does not grow
+    assert(Mem_BumpRelease(bump, inner + 4096) == -1);
+    assert(Mem_BumpAlloc(bump, 8192) == NULL);
+    assert(Mem_BumpDestroy(bump) == 0);
+}
+
+/* Checks the root object written by testPersistent */
+void checkRoot(mem_heap *heap)
+{
+    long *root = Mem_HeapGetRoot(heap);
+    assert(root != NULL);
+    for (int i = 0; i < 10; i++)
+    {
+        assert(root[i] == i * i);
+    }
+    checkArena(heap);
+}
+
+/* A heap file comes back with its blocks and its root object, at the same */
+/* address or, rebuilt, at another one */
+void testPersistent(int policy)
+{
+    char path[] = "/tmp/mem_heap_XXXXXX";
+    int fd = mkstemp(path);
+    assert(fd >= 0);
+    close(fd);
+
+    mem_heap *heap = Mem_HeapOpen(path, 1 << 20, policy);
+    assert(heap != NULL);
+    long *root = Mem_HeapAlloc(heap, 10 * sizeof(long));
+    assert(root != NULL);
+    for (int i = 0; i < 10; i++)
+    {
+        root[i] = i * i;
+    }
+    assert(Mem_HeapSetRoot(heap, root) == 0);
+    assert(Mem_HeapFree(heap, Mem_HeapAlloc(heap, 500)) == 0);
+    //One process at a time
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0)
+    {
+        _exit(Mem_HeapOpen(path, 0, 0) == NULL ? 0 : 1);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    char *base = (char *)heap->file;
+    assert(Mem_HeapDestroy(heap) == 0);
+
+    heap = Mem_HeapOpen(path, 0, 0);
+    assert(heap != NULL && (char *)heap->file == base);
+    checkRoot(heap);
+    assert(Mem_HeapDestroy(heap) == 0);
+
+    //Keep the old address taken, the file is mapped elsewhere and rebuilt
+    assert(mmap(base, getpagesize(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == base);
+    heap = Mem_HeapOpen(path, 0, 0);
+    assert(heap != NULL && (char *)heap->file != base);
+    checkRoot(heap);
+    assert(Mem_HeapFree(heap, Mem_HeapGetRoot(heap)) == 0);
+    assert(Mem_HeapGetRoot(heap) == NULL);
+    assert(Mem_HeapDestroy(heap) == 0);
+    unlink(path);
 }
 
 int main()
 {
+    testEachPolicy(testCoalesce);
+    testEachPolicy(testValidate);
+    testInChild(testBestFit, 0);
+    testInChild(testWorstFit, 2);
+    testInChild(testTlsf, 3);
+    testEachPolicy(testThreadCache);
+    testEachPolicy(testArenas);
+    testEachPolicy(testGrowth);
+    testEachPolicy(testSlabs);
+    testEachPolicy(testRealloc);
+    testEachPolicy(testCalloc);
+    testEachPolicy(testAligned);
+    testEachPolicy(testHeader);
+    testEachPolicy(testHugePages);
+    testEachPolicy(testLargeRegion);
+    testEachPolicy(testDirectMap);
+    testEachPolicy(testBatch);
+    testEachPolicy(testStats);
+    testInChild(testTrace, 1);
+    testEachPolicy(testCrossThread);
+    testEachPolicy(testFork);
+    testEachPolicy(testDeferred);
+    testInChild(testBuddy, 4);
+    testEachPolicy(testHeaps);
+    testEachPolicy(testBump);
+    testEachPolicy(testPersistent);
+
+    //The first fit sequence, in this process
     assert(Mem_Init(4096, 1) == 0);
     void* ptr[9];
     void* test;
@@ -850,6 +5345,10 @@ int main()
 
     assert(Mem_Free(ptr[7]) == 0);
 
+    //Double frees, interior and foreign pointers are rejected
+    assert(Mem_Free(ptr[7]) == -1);
+    assert(Mem_Free((char *)ptr[6] + 8) == -1);
+    assert(Mem_Free(&test) == -1);
 
 
     test = Mem_Alloc(50);
@@ -867,3 +5366,4 @@ int main()
     );
     exit(0);
 }
+#endif
@@ -1,11 +1,101 @@
 #ifndef __mem_h__
 #define __mem_h__
 
-int Mem_Init(int sizeOfRegion,int policy);
-void *Mem_Alloc(int size);
+#include <stddef.h>
+
+/* Options for Mem_SetOption, to be set before Mem_Init */
+#define MEM_OPT_ARENAS 1
+#define MEM_OPT_MAX_FOOTPRINT 2
+#define MEM_OPT_GROWTH_FACTOR 3
+#define MEM_OPT_HUGE_PAGES 4
+#define MEM_OPT_MMAP_THRESHOLD 5
+#define MEM_OPT_DEFER_COALESCE 6
+
+/* Heap statistics, filled in by Mem_GetStats */
+typedef struct
+{
+    /* Objects handed out and not freed yet, and their usable bytes */
+    size_t in_use_blocks;
+    size_t in_use_bytes;
+    /* Free blocks of the arenas, and the free bytes of the heap: their */
+    /* payloads, the free slab slots and the small objects waiting in thread */
+    /* caches. The cached objects are counted at the size of their class, so */
+    /* a few bytes of a cached block may show as in use */
+    size_t free_blocks;
+    size_t free_bytes;
+    /* Reading it is O(1) except under first fit, which walks the block list, */
+    /* and TLSF, which walks the free list of its highest class */
+    size_t largest_free;
+    /* 1 - largest_free / free_bytes, 0 when the free memory is in one piece */
+    double fragmentation;
+    /* Large objects mapped on their own, included in the in use figures */
+    size_t mapped_blocks;
+    size_t mapped_bytes;
+    /* Bytes mapped for the heap as a whole, arenas and direct mappings */
+    size_t footprint;
+    /* Calls that handed out memory, freed it, or found none */
+    unsigned long allocs;
+    unsigned long frees;
+    unsigned long failures;
+    /* Free blocks looked at per search of the allocation policy */
+    double avg_walk;
+    unsigned long max_walk;
+} mem_stats;
+
+/* Allocation traces, see Mem_Trace and replay.c */
+#define MEM_TRACE_MAGIC 0x4543415254454d4dUL /* "MEMTRACE" */
+#define MEM_TRACE_VERSION 2
+#define MEM_TRACE_ALLOC 1
+#define MEM_TRACE_FREE 2
+#define MEM_TRACE_REALLOC 3
+#define MEM_TRACE_ALLOC_ALIGNED 4
+/* The kind of event is in the low MEM_TRACE_OP_BITS bits of op. An aligned */
+/* allocation keeps log2 of its alignment above them. Version 1 traces have */
+/* no aligned allocations, they are recorded as plain ones */
+#define MEM_TRACE_OP_BITS 8
+
+/* One event of a trace, a trace file is an array of them. The first one is a */
+/* header with op 0, id MEM_TRACE_VERSION and size MEM_TRACE_MAGIC */
+typedef struct
+{
+    unsigned int op;
+    /* Logical id of the object, numbered from 1 in allocation order */
+    unsigned int id;
+    /* Bytes asked for, 0 for a free */
+    unsigned long size;
+} mem_trace_event;
+
+/* Heap of its own, made by Mem_HeapCreate and independent of Mem_Init */
+typedef struct arena_hd mem_heap;
+
+/* Bump arena for short-lived objects, made by Mem_BumpCreate */
+typedef struct bump_hd mem_bump;
+
+int Mem_SetOption(int option, long value);
+int Mem_Init(size_t sizeOfRegion,int policy);
+void *Mem_Alloc(size_t size);
+void *Mem_AllocAligned(size_t alignment, size_t size);
+void *Mem_Calloc(size_t count, size_t size);
+void *Mem_Realloc(void *ptr, size_t size);
 int Mem_Free(void *ptr);
+size_t Mem_UsableSize(void *ptr);
+size_t Mem_AllocBatch(size_t count, size_t size, void **out);
+int Mem_FreeBatch(void **ptrs, size_t count);
+int Mem_GetStats(mem_stats *stats);
+int Mem_Trace(const char *path);
+mem_heap *Mem_HeapCreate(size_t sizeOfRegion, int policy);
+void *Mem_HeapAlloc(mem_heap *heap, size_t size);
+int Mem_HeapFree(mem_heap *heap, void *ptr);
+int Mem_HeapReset(mem_heap *heap);
+int Mem_HeapDestroy(mem_heap *heap);
+mem_heap *Mem_HeapOpen(const char *path, size_t sizeOfRegion, int policy);
+int Mem_HeapSetRoot(mem_heap *heap, void *ptr);
+void *Mem_HeapGetRoot(mem_heap *heap);
+mem_bump *Mem_BumpCreate(size_t size);
+void *Mem_BumpAlloc(mem_bump *bump, size_t size);
+size_t Mem_BumpMark(mem_bump *bump);
+int Mem_BumpRelease(mem_bump *bump, size_t mark);
+int Mem_BumpDestroy(mem_bump *bump);
 void Mem_Dump();
 
 #endif // __mem_h__
-
-
@@ -0,0 +1,284 @@
+/******************************************************************************
+ * FILENAME: preload.c
+ * PROVIDES: The malloc family on top of the Mem_* functions, so that programs
+ *           run on this allocator without being recompiled
+ * BUILD:    gcc -O2 -shared -fPIC -ftls-model=initial-exec -pthread -DMEM_NO_MAIN
+ *           mem.c preload.c -o libmem.so
+ * USAGE:    LD_PRELOAD=./libmem.so program
+ *           MEM_POLICY=0..4 picks the allocation policy (default 3, TLSF)
+ * *****************************************************************************/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mem.h"
+
+/* The heap is set up by the first call, whichever thread makes it, with one */
+/* arena per CPU, and grows on demand from there */
+#define PRELOAD_REGION (4L << 20)
+#define PRELOAD_FOOTPRINT (1L << 36)
+#define PRELOAD_POLICY 3
+
+/* While Mem_Init runs, the C library may allocate on its behalf (pthread_atfork, */
+/* atexit). Those calls are served from a static pool by bumping a pointer; */
+/* its blocks are never given back. The size of each sits in the 8 bytes */
+/* before it, for realloc and malloc_usable_size */
+#define EARLY_POOL (64 * 1024)
+
+char early_pool[EARLY_POOL] __attribute__((aligned(16)));
+long early_used = 0;
+
+/* 0 before the first call, 1 while Mem_Init runs, 2 once the heap is ready, */
+/* 3 if Mem_Init failed, which stops the process */
+int preload_state = 0;
+pthread_mutex_t preload_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Set in the thread that runs Mem_Init */
+__thread int preload_initializing = 0;
+
+/* Carves 'size' bytes aligned to 'align' (at least 16) from the early pool */
+/* Returns NULL when the pool is used up */
+/* Safe to call from several threads at once */
+void *earlyAlloc(size_t size, size_t align)
+{
+    if (align < 16)
+    {
+        align = 16;
+    }
+    long used = __atomic_load_n(&early_used, __ATOMIC_RELAXED);
+    long start;
+    do
+    {
+        start = (used + 16 + (long)align - 1) & ~((long)align - 1);
+        if (size > EARLY_POOL || start + (long)size > EARLY_POOL)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+    } while (!__atomic_compare_exchange_n(&early_used, &used, start + (long)size, 1, __ATOMIC_RELAXED,
+        __ATOMIC_RELAXED));
+    *(size_t *)(early_pool + start - sizeof(size_t)) = size;
+    return early_pool + start;
+}
+
+int isEarly(void *ptr)
+{
+    return (char *)ptr >= early_pool && (char *)ptr < early_pool + EARLY_POOL;
+}
+
+size_t earlySize(void *ptr)
+{
+    return *((size_t *)ptr - 1);
+}
+
+/* A fork while another thread sets the heap up must not leave the child with */
+/* preload_lock taken. These run before the handlers of Mem_Init, which are */
+/* registered first, so the locks are taken in the order ready() nests them */
+void preloadForkPrepare()
+{
+    pthread_mutex_lock(&preload_lock);
+}
+
+void preloadForkRelease()
+{
+    pthread_mutex_unlock(&preload_lock);
+}
+
+/* The early pool only carries Mem_Init through, it cannot stand in for the */
+/* heap. Says so without allocating and stops the process */
+void preloadFail()
+{
+    static const char message[] = "Error:preload.c: Mem_Init failed, there is no heap to allocate from\n";
+    ssize_t written = write(STDERR_FILENO, message, sizeof(message) - 1);
+    (void)written;
+    abort();
+}
+
+/* Sets the heap up on the first call */
+/* Returns 1 when the heap is ready, 0 when the caller has to use the early pool */
+/* Stops the process if the heap cannot be set up */
+int ready()
+{
+    if (__atomic_load_n(&preload_state, __ATOMIC_ACQUIRE) == 2)
+    {
+        return 1;
+    }
+    //A call made by Mem_Init itself, the lock is ours already
+    if (preload_initializing)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&preload_lock);
+    if (preload_state == 0)
+    {
+        preload_initializing = 1;
+        preload_state = 1;
+        char *policy = getenv("MEM_POLICY");
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        Mem_SetOption(MEM_OPT_ARENAS, cpus < 1 ? 1 : cpus > 64 ? 64 : cpus);
+        if (Mem_SetOption(MEM_OPT_MAX_FOOTPRINT, PRELOAD_FOOTPRINT) != 0)
+        {
+            Mem_SetOption(MEM_OPT_MAX_FOOTPRINT, 0xffe00000L);
+        }
+        int result = Mem_Init(PRELOAD_REGION, policy != NULL ? atoi(policy) : PRELOAD_POLICY);
+        pthread_atfork(preloadForkPrepare, preloadForkRelease, preloadForkRelease);
+        preload_initializing = 0;
+        __atomic_store_n(&preload_state, result == 0 ? 2 : 3, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&preload_lock);
+    if (preload_state == 3)
+    {
+        preloadFail();
+    }
+    return 1;
+}
+
+void *malloc(size_t size)
+{
+    if (!ready())
+    {
+        return earlyAlloc(size, 16);
+    }
+    //malloc(0) has to return a pointer that can be freed
+    void *ptr = Mem_Alloc(size == 0 ? 1 : size);
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    //Foreign pointers are rejected by Mem_Free, and early blocks are kept
+    if (ptr != NULL && !isEarly(ptr))
+    {
+        Mem_Free(ptr);
+    }
+}
+
+void *calloc(size_t count, size_t size)
+{
+    if (size != 0 && count > (size_t)-1 / size)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!ready())
+    {
+        //The pool is never reused, so it is still zero
+        return earlyAlloc(count * size, 16);
+    }
+    if (count == 0 || size == 0)
+    {
+        count = 1;
+        size = 1;
+    }
+    void *ptr = Mem_Calloc(count, size);
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return malloc(size);
+    }
+    if (size == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+    if (isEarly(ptr))
+    {
+        void *moved = malloc(size);
+        if (moved != NULL)
+        {
+            memcpy(moved, ptr, earlySize(ptr) < size ? earlySize(ptr) : size);
+        }
+        return moved;
+    }
+    //Any other block is not ours without a heap, and stays as it is
+    if (!ready())
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *moved = Mem_Realloc(ptr, size);
+    if (moved == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return moved;
+}
+
+/* Allocations aligned to a power of two 'alignment' */
+void *alignedAlloc(size_t alignment, size_t size)
+{
+    if (!ready())
+    {
+        return earlyAlloc(size, alignment);
+    }
+    void *ptr = Mem_AllocAligned(alignment, size == 0 ? 1 : size);
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+int posix_memalign(void **out, size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment % sizeof(void *) != 0)
+    {
+        return EINVAL;
+    }
+    void *ptr = alignedAlloc(alignment, size);
+    if (ptr == NULL)
+    {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return alignedAlloc(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    return aligned_alloc(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return alignedAlloc((size_t)getpagesize(), size);
+}
+
+void *pvalloc(size_t size)
+{
+    size_t pagesize = (size_t)getpagesize();
+    return alignedAlloc(pagesize, (size + pagesize - 1) / pagesize * pagesize);
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    if (ptr != NULL && isEarly(ptr))
+    {
+        return earlySize(ptr);
+    }
+    return Mem_UsableSize(ptr);
+}
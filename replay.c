@@ -0,0 +1,199 @@
+/******************************************************************************
+ * FILENAME: replay.c
+ * PROVIDES: Plays an allocation trace recorded with Mem_Trace back against
+ *           every allocation policy and reports how each of them does
+ * BUILD:    gcc -O2 -pthread -DMEM_NO_MAIN mem.c replay.c -o replay
+ * USAGE:    ./replay trace [region_size]
+ * *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "mem.h"
+
+/* Mem_Init can only be called once per process, so every policy is replayed */
+/* in a child process of its own */
+#define POLICIES 5
+/* Fragmentation is sampled this many times over the trace */
+#define SAMPLES 10
+/* Region handed to Mem_Init unless the command line says otherwise, the heap */
+/* grows from there up to the largest footprint the build allows */
+#define DEFAULT_REGION (1L << 20)
+
+const char *policy_names[POLICIES] = { "best fit", "first fit", "worst fit", "TLSF", "buddy" };
+
+double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+/* Reads the trace at 'path' into memory */
+/* Returns its events, header excluded, or NULL when it is not a trace */
+mem_trace_event *readTrace(const char *path, long *count)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Error:replay.c: Cannot open %s\n", path);
+        return NULL;
+    }
+    mem_trace_event header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.op != 0
+        || header.size != MEM_TRACE_MAGIC || header.id < 1 || header.id > MEM_TRACE_VERSION)
+    {
+        fprintf(stderr, "Error:replay.c: %s is not a trace of this version\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    long capacity = 4096;
+    mem_trace_event *events = malloc(capacity * sizeof(mem_trace_event));
+    *count = 0;
+    while (events != NULL)
+    {
+        *count = *count + (long)fread(events + *count, sizeof(mem_trace_event),
+            capacity - *count, file);
+        if (*count < capacity)
+        {
+            break;
+        }
+        capacity = capacity * 2;
+        events = realloc(events, capacity * sizeof(mem_trace_event));
+    }
+    fclose(file);
+    return events;
+}
+
+/* Runs 'events' against 'policy' and prints the results */
+/* Meant to run in a child process, the heap is not torn down afterwards */
+void replayPolicy(mem_trace_event *events, long count, int policy, long region_size)
+{
+    unsigned int max_id = 0;
+    for (long n = 0; n < count; n++)
+    {
+        if (events[n].id > max_id)
+        {
+            max_id = events[n].id;
+        }
+    }
+    void **objects = calloc((size_t)max_id + 1, sizeof(void *));
+    if (objects == NULL)
+    {
+        fprintf(stderr, "Error:replay.c: Out of memory\n");
+        return;
+    }
+
+    //Let the heap grow as far as this build can take it
+    if (Mem_SetOption(MEM_OPT_MAX_FOOTPRINT, 1L << 36) != 0)
+    {
+        Mem_SetOption(MEM_OPT_MAX_FOOTPRINT, 0xffe00000L);
+    }
+    if (Mem_Init((size_t)region_size, policy) != 0)
+    {
+        return;
+    }
+
+    double elapsed = 0;
+    long failures = 0;
+    size_t peak = 0;
+    double fragmentation[SAMPLES];
+    mem_stats stats;
+    for (int sample = 0; sample < SAMPLES; sample++)
+    {
+        long end = count * (sample + 1) / SAMPLES;
+        double start = now();
+        for (long n = count * sample / SAMPLES; n < end; n++)
+        {
+            unsigned int id = events[n].id;
+            switch (events[n].op & ((1U << MEM_TRACE_OP_BITS) - 1))
+            {
+            case MEM_TRACE_ALLOC:
+                objects[id] = Mem_Alloc(events[n].size);
+                failures = failures + (objects[id] == NULL);
+                break;
+            case MEM_TRACE_ALLOC_ALIGNED:
+                objects[id] = Mem_AllocAligned(1UL << (events[n].op >> MEM_TRACE_OP_BITS), events[n].size);
+                failures = failures + (objects[id] == NULL);
+                break;
+            case MEM_TRACE_FREE:
+                if (objects[id] != NULL)
+                {
+                    Mem_Free(objects[id]);
+                    objects[id] = NULL;
+                }
+                break;
+            case MEM_TRACE_REALLOC: {
+                void *moved = Mem_Realloc(objects[id], events[n].size);
+                if (moved == NULL)
+                {
+                    failures++;
+                }
+                else
+                {
+                    objects[id] = moved;
+                }
+                break; }
+            default:
+                break;
+            }
+        }
+        elapsed = elapsed + now() - start;
+
+        //Sampling is not part of the timing
+        Mem_GetStats(&stats);
+        fragmentation[sample] = stats.fragmentation;
+        if (stats.footprint > peak)
+        {
+            peak = stats.footprint;
+        }
+    }
+
+    fprintf(stdout, "policy %d (%s): %ld ops, %.1f ns/op, peak footprint %zu bytes, %ld failures\n",
+        policy, policy_names[policy], count, count > 0 ? elapsed / count : 0.0, peak, failures);
+    fprintf(stdout, "  fragmentation at every %d%% of the trace:", 100 / SAMPLES);
+    for (int sample = 0; sample < SAMPLES; sample++)
+    {
+        fprintf(stdout, " %.2f", fragmentation[sample]);
+    }
+    fprintf(stdout, "\n");
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s trace [region_size]\n", argv[0]);
+        return 1;
+    }
+    long region_size = argc > 2 ? atol(argv[2]) : DEFAULT_REGION;
+    long count;
+    mem_trace_event *events = readTrace(argv[1], &count);
+    if (events == NULL)
+    {
+        return 1;
+    }
+
+    for (int policy = 0; policy < POLICIES; policy++)
+    {
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0)
+        {
+            replayPolicy(events, count, policy, region_size);
+            _exit(0);
+        }
+        if (child < 0)
+        {
+            fprintf(stderr, "Error:replay.c: Cannot fork\n");
+            return 1;
+        }
+        waitpid(child, NULL, 0);
+    }
+    free(events);
+    return 0;
+}